@@ -16,6 +16,6 @@ VDJER=../vdjer
 # num threads = 4
 # 
 # Assembled contigs appear in vdj_contigs.fa
-# Reads mapped to contigs appear in vdjer.sam
-$VDJER --in star.sort.bam --rl 50 --t 4 --ins 175 --chain IGH --ref-dir $VDJER_REF_DIR > vdjer.sam 2> vdjer.log
+# Reads mapped to contigs appear in vdjer.bam, sorted by read name
+$VDJER --in star.sort.bam --rl 50 --t 4 --ins 175 --chain IGH --ref-dir $VDJER_REF_DIR --bam vdjer.bam 2> vdjer.log
 
@@ -0,0 +1,120 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <vector>
+#include "anchor_index.h"
+
+using namespace std;
+
+bool compare_entries(const anchor_entry& e1, const anchor_entry& e2) {
+	return e1.code < e2.code;
+}
+
+void anchor_index_write(const char* filename, vector<anchor_entry>& entries) {
+
+	sort(entries.begin(), entries.end(), compare_entries);
+
+	FILE* fp = fopen(filename, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open anchor index for writing: %s\n", filename);
+		exit(-1);
+	}
+
+	anchor_index_header header;
+	memcpy(header.magic, ANCHOR_INDEX_MAGIC, sizeof(header.magic));
+	header.num_entries = entries.size();
+	header.dir_bits = ANCHOR_INDEX_DIR_BITS;
+	fwrite(&header, sizeof(header), 1, fp);
+
+	// directory[b] is the index of the first entry in bucket b
+	vector<uint32_t> directory(ANCHOR_INDEX_DIR_SIZE+1, 0);
+	for (size_t i=0; i<entries.size(); i++) {
+		directory[(entries[i].code >> (32-ANCHOR_INDEX_DIR_BITS)) + 1]++;
+	}
+	for (int b=0; b<ANCHOR_INDEX_DIR_SIZE; b++) {
+		directory[b+1] += directory[b];
+	}
+	fwrite(&directory[0], sizeof(uint32_t), directory.size(), fp);
+
+	vector<uint32_t> codes(entries.size());
+	vector<uint8_t> dists(entries.size());
+	for (size_t i=0; i<entries.size(); i++) {
+		codes[i] = entries[i].code;
+		dists[i] = entries[i].dists;
+	}
+
+	if (!entries.empty()) {
+		fwrite(&codes[0], sizeof(uint32_t), codes.size(), fp);
+		fwrite(&dists[0], sizeof(uint8_t), dists.size(), fp);
+	}
+
+	if (fclose(fp) != 0) {
+		fprintf(stderr, "Error writing anchor index: %s\n", filename);
+		exit(-1);
+	}
+}
+
+anchor_index* anchor_index_open(const char* filename) {
+
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || st.st_size < sizeof(anchor_index_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void* map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	const anchor_index_header* header = (const anchor_index_header*) map;
+	size_t expected_len = sizeof(anchor_index_header) + (ANCHOR_INDEX_DIR_SIZE+1) * sizeof(uint32_t) +
+			(size_t) header->num_entries * (sizeof(uint32_t) + sizeof(uint8_t));
+
+	if (memcmp(header->magic, ANCHOR_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+		header->dir_bits != ANCHOR_INDEX_DIR_BITS || st.st_size != expected_len) {
+		fprintf(stderr, "Invalid anchor index: %s\n", filename);
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	anchor_index* index = (anchor_index*) calloc(1, sizeof(anchor_index));
+	index->map = map;
+	index->map_len = st.st_size;
+	index->num_entries = header->num_entries;
+	index->directory = (const uint32_t*) ((const char*) map + sizeof(anchor_index_header));
+	index->codes = index->directory + ANCHOR_INDEX_DIR_SIZE+1;
+	index->dists = (const uint8_t*) (index->codes + index->num_entries);
+
+	return index;
+}
+
+void anchor_index_close(anchor_index* index) {
+	munmap(index->map, index->map_len);
+	free(index);
+}
+
+uint8_t anchor_index_lookup(const anchor_index* index, uint32_t code) {
+	uint32_t bucket = code >> (32-ANCHOR_INDEX_DIR_BITS);
+	const uint32_t* start = index->codes + index->directory[bucket];
+	const uint32_t* end = index->codes + index->directory[bucket+1];
+
+	const uint32_t* it = lower_bound(start, end, code);
+	if (it != end && *it == code) {
+		return index->dists[it - index->codes];
+	}
+
+	return 0xFF;
+}
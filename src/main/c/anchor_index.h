@@ -0,0 +1,55 @@
+#ifndef __ANCHOR_INDEX__
+#define __ANCHOR_INDEX__
+
+#include <stdint.h>
+#include <vector>
+
+//
+// Binary V / J anchor index.  Memory mapped read only, so concurrent processes on a host
+// share one copy in the page cache.
+//
+// Layout:
+//   header
+//   uint32 directory[ANCHOR_INDEX_DIR_SIZE+1]  - entry offsets by top ANCHOR_INDEX_DIR_BITS of code
+//   uint32 codes[num_entries]                   - sorted 2 bit encoded 16-mers
+//   uint8  dists[num_entries]                   - low nibble V dist, high nibble J dist
+//
+#define ANCHOR_INDEX_MAGIC "VDJAIDX1"
+#define ANCHOR_INDEX_DIR_BITS 20
+#define ANCHOR_INDEX_DIR_SIZE (1 << ANCHOR_INDEX_DIR_BITS)
+
+// Distance nibble value for kmers absent from the V or J anchor set
+#define ANCHOR_INDEX_NO_DIST 0xF
+
+struct anchor_index_header {
+	char magic[8];
+	uint32_t num_entries;
+	uint32_t dir_bits;
+};
+
+struct anchor_index {
+	void* map;
+	size_t map_len;
+	uint32_t num_entries;
+	const uint32_t* directory;
+	const uint32_t* codes;
+	const uint8_t* dists;
+};
+
+struct anchor_entry {
+	uint32_t code;
+	uint8_t dists;
+};
+
+// Write entries to file.  Entries are sorted in place.
+void anchor_index_write(const char* filename, std::vector<anchor_entry>& entries);
+
+// Map index file.  Returns NULL if the file cannot be opened or is invalid.
+anchor_index* anchor_index_open(const char* filename);
+
+void anchor_index_close(anchor_index* index);
+
+// Returns the dist byte for code, or 0xFF if code is not in the index.
+uint8_t anchor_index_lookup(const anchor_index* index, uint32_t code);
+
+#endif // __ANCHOR_INDEX__
@@ -0,0 +1,93 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "arena.h"
+
+using namespace std;
+
+void arena_init(arena* a, int chunk_size, long max_size) {
+	a->curr_chunk = -1;
+	a->chunk_used = 0;
+	a->chunk_size = chunk_size;
+	a->max_size = max_size;
+	a->size = 0;
+	a->peak = 0;
+	a->num_exhausted = 0;
+}
+
+static char* overflow_alloc(arena* a, int len) {
+	char* mem = (char*) malloc(len);
+	if (mem == NULL) {
+		fprintf(stderr, "Unable to allocate arena memory\n");
+		exit(-1);
+	}
+	a->overflow.push_back(mem);
+	return mem;
+}
+
+char* arena_alloc(arena* a, int len) {
+	a->size += len;
+	if (a->size > a->peak) {
+		a->peak = a->size;
+	}
+
+	// Oversized allocations are not carved from chunks
+	if (len > a->chunk_size) {
+		return overflow_alloc(a, len);
+	}
+
+	if (a->curr_chunk < 0 || a->chunk_used + len > a->chunk_size) {
+		if (a->curr_chunk+1 == a->chunks.size()) {
+			if (a->max_size > 0 && arena_capacity(a) + a->chunk_size > a->max_size) {
+				a->num_exhausted++;
+				return overflow_alloc(a, len);
+			}
+
+			char* chunk = (char*) malloc(a->chunk_size);
+			if (chunk == NULL) {
+				fprintf(stderr, "Unable to allocate arena memory\n");
+				exit(-1);
+			}
+			a->chunks.push_back(chunk);
+		}
+
+		a->curr_chunk++;
+		a->chunk_used = 0;
+	}
+
+	char* mem = a->chunks[a->curr_chunk] + a->chunk_used;
+	a->chunk_used += len;
+
+	return mem;
+}
+
+char* arena_strcpy(arena* a, const char* str, int len) {
+	char* copy = arena_alloc(a, len+1);
+	memcpy(copy, str, len);
+	copy[len] = '\0';
+	return copy;
+}
+
+void arena_reset(arena* a) {
+	for (vector<char*>::iterator it=a->overflow.begin(); it!=a->overflow.end(); it++) {
+		free(*it);
+	}
+	a->overflow.clear();
+
+	a->curr_chunk = -1;
+	a->chunk_used = 0;
+	a->size = 0;
+}
+
+void arena_destroy(arena* a) {
+	arena_reset(a);
+
+	for (vector<char*>::iterator it=a->chunks.begin(); it!=a->chunks.end(); it++) {
+		free(*it);
+	}
+	a->chunks.clear();
+}
+
+long arena_capacity(arena* a) {
+	return (long) a->chunks.size() * a->chunk_size;
+}
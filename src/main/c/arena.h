@@ -0,0 +1,45 @@
+#ifndef __ARENA__
+#define __ARENA__
+
+#include <vector>
+
+//
+// Bump allocator for short lived strings.  Memory is handed out from fixed size chunks
+// and released all at once by arena_reset.  Chunks are retained across resets.
+//
+// Once max_size bytes of chunks are in use, further allocations fall back to malloc.
+// These are tracked and freed on reset, and counted as exhaustion events.
+// A max_size of 0 means unbounded.
+//
+struct arena {
+	std::vector<char*> chunks;
+	int curr_chunk;
+	int chunk_used;
+	int chunk_size;
+	long max_size;
+	std::vector<char*> overflow;
+
+	// Bytes allocated since the last reset, and the high water mark
+	long size;
+	long peak;
+	long num_exhausted;
+};
+
+void arena_init(arena* a, int chunk_size, long max_size);
+
+// Return len bytes of arena memory
+char* arena_alloc(arena* a, int len);
+
+// Copy len chars of str into the arena as a null terminated string
+char* arena_strcpy(arena* a, const char* str, int len);
+
+// Release all allocations.  Chunks are kept for reuse.
+void arena_reset(arena* a);
+
+// Release all memory held by the arena
+void arena_destroy(arena* a);
+
+// Bytes of chunk memory held by the arena
+long arena_capacity(arena* a);
+
+#endif // __ARENA__
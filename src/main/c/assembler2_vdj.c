@@ -11,6 +11,7 @@
 #include <list>
 #include <queue>
 #include <utility>
+#include <algorithm>
 #include <vector>
 #include <sparsehash/sparse_hash_map>
 #include <sparsehash/sparse_hash_set>
@@ -24,6 +25,7 @@
 #include "quick_map3.h"
 #include "seq_dist.h"
 #include "params.h"
+#include "window_registry.h"
 
 using namespace std;
 using google::sparse_hash_map;
@@ -40,13 +42,20 @@ extern int get_read_length(char* bam_file);
 extern char coverage_is_valid(int read_length, int contig_len, int eval_start, int eval_stop, int read_span,
 		               int insert_low, int insert_high, int floor, vector<mapped_pair>& mapped_reads,
 		               vector<pair<int,int> >& start_positions, char is_debug, int mate_span);
+extern void mate_coverage_region(int read_length, int eval_start, int eval_stop, int mate_span,
+		int insert_low, int insert_high, int& start, int& end);
 
 // quick_map3.c
-extern void quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>& mapped_reads,
-		vector<pair<int,int> >& start_positions);
+extern char quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>& mapped_reads,
+		vector<pair<int,int> >& start_positions, coverage_gate* gate);
 
 // quick_map3.c
-extern void quick_map_process_contig_file(char* contig_file);
+extern void quick_map_output_contigs(vector<sam_contig>& contigs, int num_threads);
+extern void quick_map_output_bam(vector<sam_contig>& contigs, int num_threads, char* bam_file, char* command_line);
+extern void quick_map_set_max_mismatches(int max_mismatches);
+
+// quant.c
+extern void quantify_contigs(vector<sam_contig>& contigs, const char* output_file);
 
 #define MIN_CONTIG_SIZE 550
 #define MAX_CONTIG_SIZE 650
@@ -62,6 +71,8 @@ extern void quick_map_process_contig_file(char* contig_file);
 #define TOO_MANY_CONTIGS -2
 #define STOPPED_ON_REPEAT -3
 #define TOO_MANY_NODES -4
+#define ROOT_TIME_EXCEEDED -5
+#define ROOT_MEMORY_EXCEEDED -6
 
 #define MAX_FREQUENCY 32766
 #define MAX_QUAL_SUM 255
@@ -81,16 +92,25 @@ extern void quick_map_process_contig_file(char* contig_file);
 
 #define VREGION_BUF_MAX 10000000
 
-pthread_mutex_t running_thread_mutex;
-pthread_mutex_t contig_writer_mutex;
+// Fixed point scale for log10 path scores
+#define SCORE_SCALE 65536
 
-int running_threads = 0;
+// j_dist for nodes that cannot reach a J anchor node
+#define J_UNREACHABLE 32767
+
+// Each retry of a root that exceeded its budget raises the score floor by this much (log10 scale)
+#define ROOT_RETRY_SCORE_STEP 1.0
+
+// Retries at or beyond this attempt only follow the ROOT_BEAM_WIDTH most frequent successors at each branch
+#define ROOT_BEAM_ATTEMPT 2
+#define ROOT_BEAM_WIDTH 2
 
-// Tracks vjf windows
-const char* DELETED_KEY = "<DELETED>";
-dense_hash_map<const char*, const char*, contig_hash, contig_eqstr> vjf_windows;
+// Check wall time / memory budgets every this many traversal steps
+#define ROOT_BUDGET_CHECK_INTERVAL 1024
 
-dense_hash_set<const char*, vjf_hash, vjf_eqstr> vjf_window_candidates;
+pthread_mutex_t running_thread_mutex;
+
+int running_threads = 0;
 
 params p;
 
@@ -122,6 +142,11 @@ struct node {
 	char is_filtered;
 	char has_vmer;
 	char has_jmer;
+	// Reachability index.  Populated after graph condensation.
+	short j_dist;    // min bases appended before reaching a J anchor node's predecessor
+	short max_ext;   // max bases a contig can grow by from this node (capped)
+	// Stop codons contained in the condensed seq.  See vjf_stop_codons.
+	uint64_t* stop_codons;
 };
 
 struct pre_node {
@@ -135,6 +160,8 @@ struct pre_node {
 struct linked_node {
 	struct node* node;
 	struct linked_node* next;
+	// Fixed point log10 transition probability for toNodes edges.  Set after condensation.
+	int score;
 };
 
 
@@ -287,13 +314,13 @@ void add_to_graph(char* sequence, dense_hash_map<const char*, struct node*, my_h
 
 				if (kmer_size > SEQ_LEN) {
 					// Check to see if this node contains a vmer
-					unsigned long n_kmer = seq_to_int(kmer);
+					char flags = vj_anchor_flags(seq_to_int(kmer));
 
-					if (matches_vmer(n_kmer)) {
+					if (flags & VJ_ANCHOR_V) {
 						curr->has_vmer = 1;
 					}
 
-					if (matches_jmer(n_kmer)) {
+					if (flags & VJ_ANCHOR_J) {
 						curr->has_jmer = 1;
 					}
 				} else {
@@ -641,6 +668,10 @@ void condense_graph(dense_hash_map<const char*, struct node*, my_hash, eqstr>* n
 				// Update node
 				node->seq = seq;
 				node->is_condensed = 1;
+
+				int seq_len = strlen(seq);
+				node->stop_codons = (uint64_t*) calloc(VJF_STOP_WORDS(seq_len), sizeof(uint64_t));
+				vjf_stop_codons(seq, seq_len, node->stop_codons);
 				node->toNodes = last;
 				node->has_vmer = has_vmer;
 				node->has_jmer = has_jmer;
@@ -649,6 +680,177 @@ void condense_graph(dense_hash_map<const char*, struct node*, my_hash, eqstr>* n
 	}
 }
 
+//
+// Precompute fixed point transition scores for all outgoing edges so that
+// traversal does not need to sum frequencies or call log10.
+//
+void compute_edge_scores(dense_hash_map<const char*, struct node*, my_hash, eqstr>* nodes) {
+	for (dense_hash_map<const char*, struct node*, my_hash, eqstr>::const_iterator it = nodes->begin();
+	         it != nodes->end(); ++it) {
+		struct node* node = it->second;
+
+		int total_edge_count = 0;
+		for (struct linked_node* to = node->toNodes; to != NULL; to = to->next) {
+			total_edge_count += to->node->frequency;
+		}
+
+		double log10_total_edge_count = log10(total_edge_count);
+		for (struct linked_node* to = node->toNodes; to != NULL; to = to->next) {
+			to->score = (int) lround((log10(to->node->frequency) - log10_total_edge_count) * SCORE_SCALE);
+		}
+	}
+}
+
+// Bases appended to a contig when traversing through node
+inline int node_step_len(struct node* node) {
+	return node->is_condensed ? strlen(node->seq) : 1;
+}
+
+// Bases appended to a contig when it terminates at node
+inline int node_leaf_len(struct node* node) {
+	return node->is_condensed ? strlen(node->seq) : kmer_size;
+}
+
+//
+// Compute per node distance to the nearest downstream J anchor and the longest possible
+// extension over the condensed graph.  Both are computed backwards from J anchor / leaf
+// nodes over a reverse adjacency of nodes reachable during traversal.  build_contigs uses
+// these to drop branches that can never produce a contig passing output_contig's filters.
+//
+void build_reachability_index(dense_hash_map<const char*, struct node*, my_hash, eqstr>* nodes, struct_pool* pool) {
+
+	int num_nodes = pool->idx;
+	struct node* base = pool->nodes;
+
+	// Reverse adjacency in CSR form.  Chain nodes absorbed during condensation are skipped.
+	vector<int> pred_start(num_nodes+1, 0);
+	for (int i=0; i<num_nodes; i++) {
+		if (!base[i].is_filtered) {
+			for (struct linked_node* to = base[i].toNodes; to != NULL; to = to->next) {
+				pred_start[to->node - base + 1] += 1;
+			}
+		}
+	}
+
+	for (int i=0; i<num_nodes; i++) {
+		pred_start[i+1] += pred_start[i];
+	}
+
+	vector<int> preds(pred_start[num_nodes]);
+	vector<int> pred_fill(pred_start.begin(), pred_start.end()-1);
+	for (int i=0; i<num_nodes; i++) {
+		if (!base[i].is_filtered) {
+			for (struct linked_node* to = base[i].toNodes; to != NULL; to = to->next) {
+				preds[pred_fill[to->node - base]++] = i;
+			}
+		}
+	}
+
+	// Nearest J anchor.  Bucketed Dijkstra, distances beyond the max contig size are irrelevant.
+	int max_j_dist = MAX_CONTIG_SIZE - kmer_size - 1;
+	vector<vector<int> > buckets(max_j_dist);
+
+	for (int i=0; i<num_nodes; i++) {
+		base[i].j_dist = J_UNREACHABLE;
+	}
+
+	for (int i=0; i<num_nodes; i++) {
+		if (!base[i].is_filtered && base[i].has_jmer) {
+			for (int j=pred_start[i]; j<pred_start[i+1]; j++) {
+				struct node* pred = &base[preds[j]];
+				if (!pred->has_jmer && pred->j_dist > 0) {
+					pred->j_dist = 0;
+					buckets[0].push_back(preds[j]);
+				}
+			}
+		}
+	}
+
+	for (int dist=0; dist<max_j_dist; dist++) {
+		for (int b=0; b<buckets[dist].size(); b++) {
+			int i = buckets[dist][b];
+			if (base[i].j_dist != dist) {
+				continue;
+			}
+
+			for (int j=pred_start[i]; j<pred_start[i+1]; j++) {
+				struct node* pred = &base[preds[j]];
+				int pred_dist = dist + node_step_len(pred);
+				if (!pred->has_jmer && pred_dist < max_j_dist && pred_dist < pred->j_dist) {
+					pred->j_dist = pred_dist;
+					buckets[pred_dist].push_back(preds[j]);
+				}
+			}
+		}
+		vector<int>().swap(buckets[dist]);
+	}
+
+	// Longest extension, capped at the min contig size.  Values only increase and are bounded
+	// by the cap, so relaxation terminates on cyclic graphs.
+	vector<int> worklist;
+	vector<char> is_queued(num_nodes, 0);
+	for (int i=0; i<num_nodes; i++) {
+		if (!base[i].is_filtered) {
+			int leaf_len = node_leaf_len(&base[i]);
+			base[i].max_ext = leaf_len < MIN_CONTIG_SIZE ? leaf_len : MIN_CONTIG_SIZE;
+			worklist.push_back(i);
+			is_queued[i] = 1;
+		}
+	}
+
+	while (!worklist.empty()) {
+		int i = worklist.back();
+		worklist.pop_back();
+		is_queued[i] = 0;
+
+		for (int j=pred_start[i]; j<pred_start[i+1]; j++) {
+			struct node* pred = &base[preds[j]];
+			int ext = node_step_len(pred) + base[i].max_ext;
+			if (ext > MIN_CONTIG_SIZE) {
+				ext = MIN_CONTIG_SIZE;
+			}
+			if (ext > pred->max_ext) {
+				pred->max_ext = ext;
+				if (!is_queued[preds[j]]) {
+					worklist.push_back(preds[j]);
+					is_queued[preds[j]] = 1;
+				}
+			}
+		}
+	}
+
+	int j_reachable = 0;
+	int ext_ok = 0;
+	int total = 0;
+	for (int i=0; i<num_nodes; i++) {
+		if (!base[i].is_filtered) {
+			total++;
+			if (base[i].has_jmer || base[i].j_dist != J_UNREACHABLE) {
+				j_reachable++;
+			}
+			if (base[i].max_ext >= MIN_CONTIG_SIZE) {
+				ext_ok++;
+			}
+		}
+	}
+
+	fprintf(stderr, "Reachability index: %d nodes, %d reach J anchor, %d reach min contig size\n",
+			total, j_reachable, ext_ok);
+}
+
+// Returns true if no traversal from node can produce a contig passing output_contig's filters.
+char is_dead_branch(int real_size, char has_jmer, struct node* node) {
+
+	if (real_size + node->max_ext < MIN_CONTIG_SIZE) {
+		return 1;
+	}
+
+	if (!has_jmer && !node->has_jmer && real_size + node->j_dist >= MAX_CONTIG_SIZE-kmer_size-1) {
+		return 1;
+	}
+
+	return 0;
+}
 
 struct linked_node* identify_root_nodes(dense_hash_map<const char*, struct node*, my_hash, eqstr>* nodes) {
 
@@ -676,10 +878,11 @@ struct linked_node* identify_root_nodes(dense_hash_map<const char*, struct node*
 }
 
 struct contig {
-	vector<char*>* fragments;
+	// Nodes whose sequence makes up the contig
+	vector<struct node*>* fragments;
 	struct node* curr_node;
 	dense_hash_map<const char*, char, my_hash, eqstr>* visited_nodes;
-	double score;
+	int score;    // fixed point log10, see SCORE_SCALE
 	int real_size;
 	char is_repeat;
 	char has_vmer;
@@ -694,7 +897,7 @@ struct contig* new_contig() {
 	curr_contig->visited_nodes->set_empty_key(NULL);
 //	curr_contig->visited_nodes->resize(MAX_CONTIG_SIZE);
 	curr_contig->score = 0;
-	curr_contig->fragments = new vector<char*>();
+	curr_contig->fragments = new vector<struct node*>();
 	curr_contig->has_vmer = 0;
 	curr_contig->has_jmer = 0;
 
@@ -706,7 +909,7 @@ struct contig* copy_contig(struct contig* orig, vector<char*>& all_contig_fragme
 	struct contig* copy = (contig*) calloc(sizeof(contig), sizeof(char));
 
 	// Copy original fragments to new contig
-	copy->fragments = new vector<char*>(*(orig->fragments));
+	copy->fragments = new vector<struct node*>(*(orig->fragments));
 
 	copy->real_size = orig->real_size;
 	copy->is_repeat = orig->is_repeat;
@@ -758,19 +961,205 @@ void visit_curr_node(struct contig* contig) {
 
 int output_contigs = 0;
 
-char contains_seq(dense_hash_set<const char*, vjf_hash, vjf_eqstr>& seq_set, char* seq) {
-	dense_hash_set<const char*, vjf_hash, vjf_eqstr>::const_iterator it = seq_set.find(seq);
-	return it != seq_set.end();
+int total_contigs = 0;
+
+// Windows rejected by the coverage gate while mapping, binned by first uncovered position
+#define REJECT_HIST_BIN 25
+#define REJECT_HIST_BINS 40
+long gate_rejects[REJECT_HIST_BINS];
+long gate_mapped = 0;
+
+//
+// Map reads to window and check coverage.  Valid windows are added to the registry.
+// The caller retains ownership of window and cdr3.
+void validate_window(char* window, char* cdr3, window_fp trimmed_fp, int contig_num) {
+
+	// Window may have been validated via another candidate since it was queued
+	if (!wr_contains_window(trimmed_fp)) {
+		char contig_id[256];
+		sprintf(contig_id, "vjf_%d", contig_num);
+
+		int insert_low = p.insert_len;
+		int insert_high = p.insert_len;
+		int floor = p.read_filter_floor;
+
+		vector<mapped_pair> mapped_reads;
+		vector<pair<int,int> > start_positions;
+
+		// Positions the mate coverage check requires to be covered.  Windows with an uncovered
+		// position are rejected during mapping.
+		coverage_gate gate;
+		gate.reject_pos = 0;
+		mate_coverage_region(read_length, p.eval_start, p.eval_stop, p.filter_mate_span,
+				insert_low, insert_high, gate.cover_start, gate.cover_end);
+
+		if (!quick_map_process_contig(contig_id, (char*) window, mapped_reads, start_positions,
+				floor > 0 ? &gate : NULL)) {
+			int bin = min((gate.reject_pos-1) / REJECT_HIST_BIN, REJECT_HIST_BINS-1);
+			__sync_fetch_and_add(&gate_rejects[bin], 1);
+			return;
+		}
+		__sync_fetch_and_add(&gate_mapped, 1);
+
+		char is_debug = 0;
+
+		// If floor is greater than 0, check coverage.
+		char is_valid = floor == 0 ? 1 : coverage_is_valid(read_length, strlen(window),
+				p.eval_start, p.eval_stop, p.filter_read_span, insert_low, insert_high, floor, mapped_reads, start_positions, is_debug, p.filter_mate_span);
+
+		if (is_valid) {
+//			fprintf(stderr, "VALID_CONTIG: %s\t%d\n", contig_id, mapped_reads.size());
+
+			// Add window truncated at eval stop to registry along with the pairs mapped within it.
+			// Positions are shifted to the trimmed window.  Reads starting within READ_LEN of the
+			// trimmed end are dropped as they would not be mapped to the trimmed window.
+			vector<pair_mapping> mappings;
+			int offset = p.eval_start-1;
+			int max_pos = CONTIG_SIZE - read_length;
+			for (int i=0; i<mapped_reads.size(); i++) {
+				mapped_pair& mp = mapped_reads[i];
+				int pos1 = mp.pos1 - offset;
+				int pos2 = mp.pos2 - offset;
+				if (pos1 >= 1 && pos1 <= max_pos && pos2 >= 1 && pos2 <= max_pos) {
+					pair_mapping mapping;
+					mapping.r1 = mp.r1;
+					mapping.r2 = mp.r2;
+					mapping.pos1 = pos1;
+					mapping.pos2 = pos2;
+					mapping.insert = mp.insert;
+					mapping.mismatches1 = mp.mismatches1;
+					mapping.mismatches2 = mp.mismatches2;
+					mappings.push_back(mapping);
+				}
+			}
+
+			wr_add_window(trimmed_fp, window + offset, CONTIG_SIZE, cdr3, mappings);
+		} else {
+//			fprintf(stderr, "INVALID_CONTIG: %s\t%d\n", contig_id, mapped_reads.size());
+		}
+	}
 }
 
-char contains_seq(dense_hash_map<const char*, const char*, contig_hash, contig_eqstr>& seq_set, char* seq) {
-	dense_hash_map<const char*, const char*, contig_hash, contig_eqstr>::const_iterator it = seq_set.find(seq);
-	return it != seq_set.end();
+//
+// Bounded queue of candidate windows handed from traversal threads to the validation pool.
+// Traversal threads block when the queue is full.
+struct window_task {
+	char* window;
+	char* cdr3;
+	window_fp trimmed_fp;
+	int contig_num;
+};
+
+struct validation_queue {
+	window_task* tasks;
+	int capacity;
+	int head;
+	int size;
+	char is_closed;
+	pthread_mutex_t mutex;
+	pthread_cond_t not_full;
+	pthread_cond_t not_empty;
+};
+
+validation_queue vqueue;
+
+void vqueue_init(validation_queue* queue, int capacity) {
+	queue->tasks = (window_task*) calloc(capacity, sizeof(window_task));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->size = 0;
+	queue->is_closed = 0;
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
 }
 
+void vqueue_destroy(validation_queue* queue) {
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	free(queue->tasks);
+}
 
-int contig_num = 1;
-int total_contigs = 0;
+void vqueue_push(validation_queue* queue, window_task task) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->size == queue->capacity) {
+		pthread_cond_wait(&queue->not_full, &queue->mutex);
+	}
+	queue->tasks[(queue->head + queue->size) % queue->capacity] = task;
+	queue->size++;
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+// Returns 0 once the queue is closed and drained
+char vqueue_pop(validation_queue* queue, window_task& task) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->size == 0 && !queue->is_closed) {
+		pthread_cond_wait(&queue->not_empty, &queue->mutex);
+	}
+
+	char is_popped = 0;
+	if (queue->size > 0) {
+		task = queue->tasks[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->size--;
+		is_popped = 1;
+		pthread_cond_signal(&queue->not_full);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+
+	return is_popped;
+}
+
+void vqueue_close(validation_queue* queue) {
+	pthread_mutex_lock(&queue->mutex);
+	queue->is_closed = 1;
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+void* validation_thread(void* arg) {
+	window_task task;
+	while (vqueue_pop(&vqueue, task)) {
+		validate_window(task.window, task.cdr3, task.trimmed_fp, task.contig_num);
+
+		// Queued windows are copied out of the traversal thread's arena
+		free(task.window);
+		free(task.cdr3);
+	}
+
+	return NULL;
+}
+
+// OR len bits of src into dst starting at bit offset
+void or_bitmap(uint64_t* dst, const uint64_t* src, int len, int offset) {
+	uint64_t* out = dst + offset / 64;
+	int shift = offset % 64;
+
+	for (int i=0; i<VJF_STOP_WORDS(len); i++) {
+		out[i] |= src[i] << shift;
+		if (shift != 0) {
+			out[i+1] |= src[i] >> (64-shift);
+		}
+	}
+}
+
+// Clear all bits from start onwards
+void clear_bitmap_from(uint64_t* bits, int start, int num_words) {
+	if (start < 0) {
+		start = 0;
+	}
+
+	int word = start / 64;
+	if (word < num_words && start % 64 != 0) {
+		bits[word] &= (1ULL << (start % 64)) - 1;
+		word++;
+	}
+	for (; word < num_words; word++) {
+		bits[word] = 0;
+	}
+}
 
 void output_contig(struct contig* contig, int& contig_count, const char* prefix, char* contigs) {
 
@@ -784,22 +1173,49 @@ void output_contig(struct contig* contig, int& contig_count, const char* prefix,
 		}
 		contig_count++;
 
-		buf[0] = '\0';
+		// Stop codons within each fragment come from the node.  Codons spanning fragments are checked below.
+		uint64_t stop_codons[VJF_STOP_WORDS(MAX_CONTIG_SIZE)+1];
+		memset(stop_codons, 0, sizeof(stop_codons));
 
-//		int length = 0;
-		for (vector<char*>::iterator it = contig->fragments->begin(); it != contig->fragments->end(); ++it) {
-			int to_cat = MAX_CONTIG_SIZE - strlen(buf);
+		int fragment_ends[MAX_CONTIG_SIZE];
+		int num_fragments = 0;
+		int buf_len = 0;
+
+		for (vector<struct node*>::iterator it = contig->fragments->begin(); it != contig->fragments->end(); ++it) {
+			int to_cat = MAX_CONTIG_SIZE - buf_len;
 			if (to_cat <= 0) {
 				break;
 			}
-			strncat(buf, *it, to_cat);
-//			length += strlen(*it);
+
+			struct node* node = *it;
+			const char* seq = node->is_condensed ? node->seq : node->kmer_seq;
+			int len = min((int) strlen(seq), to_cat);
+
+			memcpy(buf + buf_len, seq, len);
+			if (node->stop_codons != NULL) {
+				or_bitmap(stop_codons, node->stop_codons, len, buf_len);
+			}
+
+			buf_len += len;
+			fragment_ends[num_fragments++] = buf_len;
+		}
+		buf[buf_len] = '\0';
+
+		// Drop codons overrunning a truncated fragment
+		clear_bitmap_from(stop_codons, buf_len-2, sizeof(stop_codons) / sizeof(uint64_t));
+
+		for (int i=0; i<num_fragments; i++) {
+			for (int pos=max(fragment_ends[i]-2, 0); pos<fragment_ends[i] && pos+3 <= buf_len; pos++) {
+				if (vjf_is_stop_codon(buf+pos)) {
+					stop_codons[pos / 64] |= 1ULL << (pos % 64);
+				}
+			}
 		}
 
 		// Search for V / J anchors and add to hash set.
 		dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr> vjf_windows_temp;
 		vjf_windows_temp.set_empty_key(NULL);
-		vjf_search(buf, vjf_windows_temp, 1);
+		vjf_search(buf, vjf_windows_temp, 1, stop_codons);
 
 //		fprintf(stderr, "CONTIG_CANDIDATE: %s\t%d\n", buf, vjf_windows_temp.size());
 
@@ -808,109 +1224,210 @@ void output_contig(struct contig* contig, int& contig_count, const char* prefix,
 			char* window = (char*) it->first;
 			char* cdr3 = (char*) it->second;
 
-			char is_to_be_processed = 0;
-			char contig_id[256];
-
-//			CONTIG_SIZE = 390;
-//			int eval_start = 50;
-//			int eval_stop  = 439;
-
-			int insert_low = p.insert_len;
-			int insert_high = p.insert_len;
-			int floor = p.read_filter_floor;
-
-			// TODO: Use RW lock here?
-			pthread_mutex_lock(&contig_writer_mutex);
-			if (!contains_seq(vjf_window_candidates, window) && !contains_seq(vjf_windows, (window + (p.eval_start-1)))) {
-				is_to_be_processed = 1;
-				// Don't process same window twice
-				vjf_window_candidates.insert(window);
-				sprintf(contig_id, "vjf_%d", contig_num++);
-				if ((contig_num % 1000) == 0) {
-					fprintf(stderr, "Processing contig num: %d\n", contig_num);
+			// Fingerprints are computed outside of the registry locks
+			window_fp candidate_fp = window_fingerprint(window, strlen(window));
+			window_fp trimmed_fp = window_fingerprint(window + p.eval_start-1, CONTIG_SIZE);
+
+			// Don't process same window twice
+			if (!wr_contains_window(trimmed_fp) && wr_add_candidate(candidate_fp)) {
+				int contig_num = wr_next_contig_num();
+				if (((contig_num+1) % 1000) == 0) {
+					fprintf(stderr, "Processing contig num: %d\n", contig_num+1);
 				}
 
-//				fprintf(stderr, "PROCESS_CONTIG: %s\t%s\n", contig_id, *it);
+//				fprintf(stderr, "PROCESS_CONTIG: vjf_%d\t%s\n", contig_num, window);
+
+				if (p.validation_threads > 0) {
+					window_task task;
+					task.window = strdup(window);
+					task.cdr3 = strdup(cdr3);
+					task.trimmed_fp = trimmed_fp;
+					task.contig_num = contig_num;
+					vqueue_push(&vqueue, task);
+				} else {
+					validate_window(window, cdr3, trimmed_fp, contig_num);
+				}
 			}
-			pthread_mutex_unlock(&contig_writer_mutex);
+		}
 
-			if (is_to_be_processed) {
-				vector<mapped_pair> mapped_reads;
-				vector<pair<int,int> > start_positions;
+		// Windows have been copied to the registry or validation queue
+		vjf_reset_windows();
+	}
+}
 
-				quick_map_process_contig(contig_id, (char*) window, mapped_reads, start_positions);
+bool compare_windows(const window_entry& w1, const window_entry& w2) {
+	return strcmp(w1.window, w2.window) < 0;
+}
 
-				char is_debug = 0;
+//
+// Window w1 overlaps w2 if the first window_overlap_check_size bases of w2 occur in w1
+// at an offset in [1, CONTIG_SIZE-window_overlap_check_size).  Window prefixes are
+// indexed by a hash of their first OVERLAP_SEED_LEN bases, so each offset of w1 is only
+// compared against windows sharing that seed.
+//
+#define OVERLAP_SEED_LEN 32
+#define OVERLAP_SEED_BASE 0x9E3779B97F4A7C15ULL
+
+struct overlap_job {
+	vector<window_entry>* windows;
+	vector<pair<uint64_t, int> >* seeds;  // (prefix seed, window index) sorted by seed
+	vector<vector<int> >* overlaps;       // indices of windows overlapped by each window
+	int seed_len;
+	int next_window;
+};
+
+uint64_t overlap_seed(const char* seq, int len) {
+	uint64_t seed = 0;
+	for (int i=0; i<len; i++) {
+		seed = seed * OVERLAP_SEED_BASE + (unsigned char) seq[i];
+	}
+	return seed;
+}
 
-				// If floor is greater than 0, check coverage.
-				char is_valid = floor == 0 ? 1 : coverage_is_valid(read_length, strlen(window),
-						p.eval_start, p.eval_stop, p.filter_read_span, insert_low, insert_high, floor, mapped_reads, start_positions, is_debug, p.filter_mate_span);
+void* overlap_thread(void* arg) {
+	overlap_job* job = (overlap_job*) arg;
+	vector<window_entry>& windows = *job->windows;
+	vector<pair<uint64_t, int> >& seeds = *job->seeds;
+	int overlap_size = p.window_overlap_check_size;
+	int seed_len = job->seed_len;
+
+	// seed_len^th power of the base for removing the outgoing base
+	uint64_t base_pow = 1;
+	for (int i=0; i<seed_len; i++) {
+		base_pow *= OVERLAP_SEED_BASE;
+	}
 
-				if (is_valid) {
-//					fprintf(stderr, "VALID_CONTIG: %s\t%d\n", *it, mapped_reads.size());
+	int i1;
+	while ((i1 = __sync_fetch_and_add(&job->next_window, 1)) < windows.size()) {
+		const char* window1 = windows[i1].window;
+		vector<int>& overlaps = (*job->overlaps)[i1];
 
-					// Truncate assembled contig at eval stop
-					window[p.eval_start+CONTIG_SIZE-1] = '\0';
+		uint64_t seed = overlap_seed(window1+1, seed_len);
+		for (int i=1; i<CONTIG_SIZE-overlap_size; i++) {
+			if (i > 1) {
+				seed = seed * OVERLAP_SEED_BASE + (unsigned char) window1[i+seed_len-1]
+						- base_pow * (unsigned char) window1[i-1];
+			}
 
-					// Add contig to set
-					pthread_mutex_lock(&contig_writer_mutex);
-//					vjf_windows.insert(window + (EVAL_START-1));
-					vjf_windows[window + p.eval_start-1] = cdr3;
-					pthread_mutex_unlock(&contig_writer_mutex);
-				} else {
-//					fprintf(stderr, "INVALID_CONTIG: %s\t%d\n", *it, mapped_reads.size());
+			vector<pair<uint64_t, int> >::const_iterator it = lower_bound(seeds.begin(), seeds.end(), make_pair(seed, 0));
+			for (; it != seeds.end() && it->first == seed; ++it) {
+				if (strncmp(window1+i, windows[it->second].window, overlap_size) == 0) {
+					overlaps.push_back(it->second);
 				}
-			} else {
-				// TODO: Re-use buffers here...
-				free(window);
-				free(cdr3);
 			}
 		}
+
+		sort(overlaps.begin(), overlaps.end());
+		overlaps.erase(unique(overlaps.begin(), overlaps.end()), overlaps.end());
 	}
+
+	return NULL;
 }
 
-void output_windows() {
+//
+// Flag windows overlapping another window.  Windows are visited in order, and a window is
+// removed if it overlaps any window not already removed.  Overlaps are found in parallel,
+// then removal is resolved sequentially in window order so the result is deterministic.
+void remove_overlapping_windows(vector<window_entry>& windows, vector<char>& is_removed) {
 
-	// Remove overlapping windows prior to outputting.
-	for (dense_hash_map<const char*, const char*, contig_hash, contig_eqstr>::iterator it1=vjf_windows.begin(); it1!=vjf_windows.end(); it1++) {
-		char* window1 = (char*) it1->first;
+	is_removed.assign(windows.size(), 0);
 
-		char should_remove = 0;
+	int overlap_size = p.window_overlap_check_size;
+	if (CONTIG_SIZE-overlap_size <= 1) {
+		return;
+	}
 
-		for (dense_hash_map<const char*, const char*, contig_hash, contig_eqstr>::iterator it2=vjf_windows.begin(); it2!=vjf_windows.end(); it2++) {
-			char* window2 = (char*) it2->first;
+	int seed_len = overlap_size < OVERLAP_SEED_LEN ? max(overlap_size, 0) : OVERLAP_SEED_LEN;
 
-			for (int i=1; i<CONTIG_SIZE-p.window_overlap_check_size; i++) {
-				if (strncmp(window1+i, window2, p.window_overlap_check_size) == 0) {
-					should_remove = 1;
-					break;
-				}
-			}
+	vector<pair<uint64_t, int> > seeds(windows.size());
+	for (int i=0; i<windows.size(); i++) {
+		seeds[i] = make_pair(overlap_seed(windows[i].window, seed_len), i);
+	}
+	sort(seeds.begin(), seeds.end());
 
-			if (should_remove) {
-				break;
-			}
+	vector<vector<int> > overlaps(windows.size());
+
+	overlap_job job;
+	job.windows = &windows;
+	job.seeds = &seeds;
+	job.overlaps = &overlaps;
+	job.seed_len = seed_len;
+	job.next_window = 0;
+
+	int num_threads = max(p.threads, 1);
+	vector<pthread_t> threads(num_threads);
+	for (int i=0; i<num_threads; i++) {
+		int ret = pthread_create(&threads[i], NULL, overlap_thread, &job);
+		if (ret != 0) {
+			fprintf(stderr, "Error creating overlap thread: %d\n", ret);
+			exit(-1);
 		}
+	}
 
-		if (should_remove) {
-			vjf_windows.erase(it1);
+	for (int i=0; i<num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	int num_removed = 0;
+	for (int i1=0; i1<windows.size(); i1++) {
+		for (int j=0; j<overlaps[i1].size(); j++) {
+			if (!is_removed[overlaps[i1][j]]) {
+				is_removed[i1] = 1;
+				num_removed++;
+				break;
+			}
 		}
 	}
 
+	fprintf(stderr, "Removed %d of %ld windows overlapping another window\n", num_removed, windows.size());
+}
+
+void output_windows() {
+
+	vector<window_entry> windows;
+	wr_get_windows(windows);
+
+	// Registry order depends on thread timing.  Sort for reproducible overlap removal and output.
+	sort(windows.begin(), windows.end(), compare_windows);
+	vector<char> is_removed;
+	remove_overlapping_windows(windows, is_removed);
+
 	// Now output remaining contigs to file
 	char* contig_file = "vdj_contigs.fa";
 	FILE* fp = fopen(contig_file, "w");
-	int contig_num = 1;
-	for (dense_hash_map<const char*, const char*, contig_hash, contig_eqstr>::iterator it=vjf_windows.begin(); it!=vjf_windows.end(); it++) {
-		char* window = (char*) it->first;
-		char* cdr3 = (char*) it->second;
-		fprintf(fp, ">vjf_%d_%s\n%s\n", contig_num++, cdr3, window);
+	vector<sam_contig> contigs;
+	char contig_id[1024];
+	for (int i=0; i<windows.size(); i++) {
+		if (!is_removed[i]) {
+			snprintf(contig_id, sizeof(contig_id), "vjf_%ld_%s", contigs.size()+1, windows[i].cdr3);
+			fprintf(fp, ">%s\n%s\n", contig_id, windows[i].window);
+
+			sam_contig contig;
+			contig.id = strdup(contig_id);
+			contig.seq = (char*) windows[i].window;
+			contig.mappings = windows[i].mappings;
+			contig.num_mappings = windows[i].num_mappings;
+			contigs.push_back(contig);
+		}
 	}
 	fclose(fp);
 
-	fprintf(stderr, "Outputting SAM\n");
-	quick_map_process_contig_file(contig_file);
+	if (p.bam_output != NULL) {
+		fprintf(stderr, "Outputting BAM\n");
+		quick_map_output_bam(contigs, p.threads, p.bam_output, p.command_line);
+	} else {
+		fprintf(stderr, "Outputting SAM\n");
+		quick_map_output_contigs(contigs, p.threads);
+	}
 	fprintf(stderr, "SAM output done.\n");
+
+	if (p.quantify) {
+		quantify_contigs(contigs, "vdj_contigs.quant");
+	}
+
+	for (int i=0; i<contigs.size(); i++) {
+		free(contigs[i].id);
+	}
 }
 
 void append_to_contig(struct contig* contig, vector<char*>& all_contig_fragments, char entire_kmer) {
@@ -920,12 +1437,12 @@ void append_to_contig(struct contig* contig, vector<char*>& all_contig_fragments
 
 	if (contig->curr_node->is_condensed) {
 		// Add condensed node sequence to fragment vector
-		contig->fragments->push_back(contig->curr_node->seq);
+		contig->fragments->push_back(contig->curr_node);
 		contig->real_size += strlen(contig->curr_node->seq);
 	} else {
 
 		if (!entire_kmer) {
-			contig->fragments->push_back(contig->curr_node->kmer_seq);
+			contig->fragments->push_back(contig->curr_node);
 			contig->real_size += 1;
 		} else {
 			char* fragment = (char*) calloc(kmer_size+1, sizeof(char));
@@ -936,16 +1453,64 @@ void append_to_contig(struct contig* contig, vector<char*>& all_contig_fragments
 	}
 }
 
+//
+// Per root traversal limits and the settings used for the current attempt.
+struct root_budget {
+	float min_score;
+	int beam_width;   // 0 to follow all successors
+	int max_secs;     // 0 for no limit
+	long max_mem;     // bytes, 0 for no limit
+	// Stats from the most recent attempt
+	long paths;
+	long pruned;
+	long mem;
+	time_t secs;
+};
+
+// Approximate traversal memory held by contigs on the stack and the fragments they reference
+long traversal_mem(long num_contigs, long num_fragment_ptrs, long num_kmer_fragments) {
+	return num_contigs * (sizeof(contig) + sizeof(vector<char*>) + sizeof(dense_hash_map<const char*, char, my_hash, eqstr>)) +
+			num_fragment_ptrs * sizeof(struct node*) + num_kmer_fragments * (kmer_size+1);
+}
+
+// Returns the frequency cutoff for following successors in beam mode.
+int beam_min_frequency(struct linked_node* to, int beam_width) {
+	int top[ROOT_BEAM_WIDTH];
+	int num_top = 0;
+
+	if (beam_width > ROOT_BEAM_WIDTH) {
+		beam_width = ROOT_BEAM_WIDTH;
+	}
+
+	while (to != NULL) {
+		int freq = to->node->frequency;
+		int i = num_top < beam_width ? num_top++ : beam_width;
+		while (i > 0 && top[i-1] < freq) {
+			if (i < beam_width) {
+				top[i] = top[i-1];
+			}
+			i--;
+		}
+		if (i < beam_width) {
+			top[i] = freq;
+		}
+		to = to->next;
+	}
+
+	return num_top > 0 ? top[num_top-1] : 0;
+}
+
 int build_contigs(
 		struct node* root,
 		int& contig_count,
 		const char* prefix,
-		int max_paths_from_root,
+		long max_paths_from_root,
 		int max_contigs,
 		char stop_on_repeat,
 		char shadow_mode,
 		char* contig_str,
-		vector<char*> & all_contig_fragments) {
+		vector<char*> & all_contig_fragments,
+		root_budget& budget) {
 
 	int status = OK;
 	stack<contig*> contigs;
@@ -960,7 +1525,15 @@ int build_contigs(
 	all_contig_fragments.clear();
 	all_contig_fragments.reserve(INIT_FRAGMENTS_PER_THREAD);
 
-	int paths_from_root = 1;
+	long paths_from_root = 1;
+	long fragment_ptrs = 0;
+	long steps = 0;
+	time_t start_time = time(NULL);
+	int min_score = (int) lround(budget.min_score * SCORE_SCALE);
+
+	budget.mem = 0;
+	budget.secs = 0;
+	budget.pruned = 0;
 
 	while ((contigs.size() > 0) && (status == OK)) {
 		// Get contig from stack
@@ -974,6 +1547,7 @@ int build_contigs(
 			contig->is_repeat = 1;
 
 			output_contig(contig, contig_count, prefix, contig_str);
+			fragment_ptrs -= contig->fragments->size();
 			free_contig(contig);
 
 			contigs.pop();
@@ -981,13 +1555,21 @@ int build_contigs(
 				status = STOPPED_ON_REPEAT;
 			}
 		}
-		else if (contig->curr_node->toNodes == NULL || contig->score < p.min_contig_score || contig->real_size >= (MAX_CONTIG_SIZE-kmer_size-1)) {
+		else if (is_dead_branch(contig->real_size, contig->has_jmer, contig->curr_node)) {
+			// Cannot reach a J anchor or the min contig size from here
+			fragment_ptrs -= contig->fragments->size();
+			free_contig(contig);
+			contigs.pop();
+			budget.pruned++;
+		}
+		else if (contig->curr_node->toNodes == NULL || contig->score < min_score || contig->real_size >= (MAX_CONTIG_SIZE-kmer_size-1)) {
 			// We've reached the end of the contig.
 			// Append entire current node.
 			append_to_contig(contig, all_contig_fragments, 1);
 
 			// Now, write the contig
 			output_contig(contig, contig_count, prefix, contig_str);
+			fragment_ptrs -= contig->fragments->size();
 			free_contig(contig);
 
 			contigs.pop();
@@ -995,39 +1577,45 @@ int build_contigs(
 		else {
 			// Append first base from current node
 			append_to_contig(contig, all_contig_fragments, 0);
+			fragment_ptrs += 1;
 
 //			visit_curr_node(contig);
 
-			// Count total edges
-			int total_edge_count = 0;
-			struct linked_node* to = contig->curr_node->toNodes;
-
-			while (to != NULL) {
-				total_edge_count = total_edge_count + to->node->frequency;
-				to = to->next;
-			}
-
-			double log10_total_edge_count = log10(total_edge_count);
+			// In beam mode, only follow the most frequent successors
+			int beam_freq = budget.beam_width > 0 ? beam_min_frequency(contig->curr_node->toNodes, budget.beam_width) : 0;
 
 			// Move current contig to next "to" node.
 			struct linked_node* to_linked_node = contig->curr_node->toNodes;
 
+			// Advance to first successor that is within the beam
+			while (to_linked_node->node->frequency < beam_freq) {
+				to_linked_node = to_linked_node->next;
+			}
+
 			contig->curr_node = to_linked_node->node;
+			int score = to_linked_node->score;
 			paths_from_root++;
 
 			// If there are multiple "to" nodes, branch the contig and push on stack
 			to_linked_node = to_linked_node->next;
 
 			while (to_linked_node != NULL) {
-				struct contig* contig_branch = copy_contig(contig, all_contig_fragments);
-				contig_branch->curr_node = to_linked_node->node;
-				contig_branch->score = contig_branch->score + log10(contig_branch->curr_node->frequency) - log10_total_edge_count;
-				contigs.push(contig_branch);
+				if (to_linked_node->node->frequency < beam_freq) {
+					// Outside of beam
+				} else if (is_dead_branch(contig->real_size, contig->has_jmer, to_linked_node->node)) {
+					budget.pruned++;
+				} else {
+					struct contig* contig_branch = copy_contig(contig, all_contig_fragments);
+					contig_branch->curr_node = to_linked_node->node;
+					contig_branch->score = contig_branch->score + to_linked_node->score;
+					contigs.push(contig_branch);
+					fragment_ptrs += contig_branch->fragments->size();
+					paths_from_root++;
+				}
 				to_linked_node = to_linked_node->next;
-				paths_from_root++;
 			}
 
-			contig->score = contig->score + log10(contig->curr_node->frequency) - log10_total_edge_count;
+			contig->score = contig->score + score;
 		}
 
 		if (contig_count >= max_contigs) {
@@ -1037,8 +1625,26 @@ int build_contigs(
 		if (paths_from_root >= max_paths_from_root) {
 			status = TOO_MANY_PATHS_FROM_ROOT;
 		}
+
+		if ((++steps % ROOT_BUDGET_CHECK_INTERVAL) == 0) {
+			long mem = traversal_mem(contigs.size(), fragment_ptrs, all_contig_fragments.size());
+			if (mem > budget.mem) {
+				budget.mem = mem;
+			}
+
+			if (budget.max_mem > 0 && mem > budget.max_mem) {
+				status = ROOT_MEMORY_EXCEEDED;
+			}
+
+			if (budget.max_secs > 0 && time(NULL) - start_time > budget.max_secs) {
+				status = ROOT_TIME_EXCEEDED;
+			}
+		}
 	}
 
+	budget.paths = paths_from_root;
+	budget.secs = time(NULL) - start_time;
+
 	while (contigs.size() > 0) {
 		struct contig* contig = contigs.top();
 		contigs.pop();
@@ -1060,74 +1666,108 @@ int build_contigs(
 	return status;
 }
 
-int processed_nodes = 0;
-
-struct thread_info {
-	queue<struct node*> roots;
-	pthread_mutex_t mutex;
-	pthread_t thread;
-};
+const char* build_status_desc(int status) {
+	switch (status) {
+		case TOO_MANY_PATHS_FROM_ROOT:
+			return "TOO_MANY_PATHS_FROM_ROOT";
+		case TOO_MANY_CONTIGS:
+			return "TOO_MANY_CONTIGS";
+		case STOPPED_ON_REPEAT:
+			return "STOPPED_ON_REPEAT";
+		case ROOT_TIME_EXCEEDED:
+			return "ROOT_TIME_EXCEEDED";
+		case ROOT_MEMORY_EXCEEDED:
+			return "ROOT_MEMORY_EXCEEDED";
+		default:
+			return "UNKNOWN";
+	}
+}
 
-int num_roots_in_thread(thread_info* thread) {
-	int count = -1;
-	pthread_mutex_lock(&thread->mutex);
-	count = thread->roots.size();
-	pthread_mutex_unlock(&thread->mutex);
+int processed_nodes = 0;
 
-	return count;
-}
+//
+// Roots that passed the homology filter.  Worker threads claim roots by atomically advancing next_root.
+vector<struct node*> root_work;
+int next_root = 0;
+int finished_threads = 0;
 
-struct node* get_next_root(thread_info* thread) {
-	struct node* root = NULL;
-	pthread_mutex_lock(&thread->mutex);
-	if (!thread->roots.empty()) {
-		root = thread->roots.front();
-		thread->roots.pop();
-	}
-	pthread_mutex_unlock(&thread->mutex);
-	return root;
+struct node* get_next_root() {
+	int idx = __sync_fetch_and_add(&next_root, 1);
+	return idx < root_work.size() ? root_work[idx] : NULL;
 }
 
-char all_roots_processed = 0;
+int abandoned_roots = 0;
+int retried_roots = 0;
+long pruned_branches = 0;
 
 void* worker_thread(void* t) {
 
-	thread_info* thread = (thread_info*) t;
-	vjf_cdr3_block_buffer = (char*) calloc(1024L*1000L, sizeof(char));
 	vector<char*> all_contig_fragments;
 
-	while (num_roots_in_thread(thread) > 0 || !all_roots_processed) {
+	struct node* source;
+	while ((source = get_next_root()) != NULL) {
 
-		struct node* source = get_next_root(thread);
+		int contig_count = 0;
+		const char* prefix = "foo";
+		int max_contigs = 50000000;
+		char stop_on_repeat = false;
+		char shadow_mode = false;
+		char* contig_str = NULL;
 
-		if (source != NULL && score_seq(source->kmer, p.min_source_homology_score)) {
+		root_budget budget;
+		budget.max_secs = p.root_max_secs;
+		budget.max_mem = (long) p.root_max_mem_mb * 1024L * 1024L;
 
-			int contig_count = 0;
-			const char* prefix = "foo";
-			int max_paths_from_root = 500000000;
-			int max_contigs = 50000000;
-			char stop_on_repeat = false;
-			char shadow_mode = false;
-			char* contig_str = NULL;
-			int status = build_contigs(source, contig_count, prefix, max_paths_from_root, max_contigs, stop_on_repeat,
-					shadow_mode, contig_str, all_contig_fragments);
+		int status = !OK;
+		int attempt = 0;
+
+		// Windows found during an attempt that exceeds its budget are retained.
+		while (status != OK && attempt <= p.root_retries) {
+			budget.min_score = p.min_contig_score + attempt * ROOT_RETRY_SCORE_STEP;
+			budget.beam_width = attempt >= ROOT_BEAM_ATTEMPT ? ROOT_BEAM_WIDTH : 0;
+			contig_count = 0;
+
+			status = build_contigs(source, contig_count, prefix, p.root_max_paths, max_contigs, stop_on_repeat,
+					shadow_mode, contig_str, all_contig_fragments, budget);
+
+			__sync_fetch_and_add(&pruned_branches, budget.pruned);
 
 			if (status != OK) {
-				fprintf(stderr, "Status: %d\n", status);
+				fprintf(stderr, "ROOT_BUDGET_EXCEEDED:\t%s\tattempt: %d\tmin_score: %f\tbeam: %d\tpaths: %ld\tsecs: %ld\tmem: %ld\t",
+						build_status_desc(status), attempt, budget.min_score, budget.beam_width, budget.paths, budget.secs, budget.mem);
+				print_kmer(source->kmer);
+				fprintf(stderr, "\n");
 				fflush(stderr);
-				exit(status);
 			}
 
-			processed_nodes += 1;
-			if ((processed_nodes % 100) == 0) {
-				fprintf(stderr, "Processed roots: %d\n", processed_nodes);
-			}
-		} else {
-//			fprintf(stderr, "Skipping root: ");
-//			print_kmer(source->kmer);
-//			fprintf(stderr, "\n");
+			attempt++;
+		}
+
+		if (attempt > 1) {
+			__sync_fetch_and_add(&retried_roots, 1);
+		}
+
+		if (status != OK) {
+			__sync_fetch_and_add(&abandoned_roots, 1);
+			fprintf(stderr, "ROOT_ABANDONED:\t%s\t", build_status_desc(status));
+			print_kmer(source->kmer);
+			fprintf(stderr, "\n");
+			fflush(stderr);
+		}
+
+		int processed = __sync_add_and_fetch(&processed_nodes, 1);
+		if ((processed % 100) == 0) {
+			fprintf(stderr, "Processed roots: %d\n", processed);
+			fprintf(stderr, "Num candidate contigs: %ld\n", wr_num_windows());
+			fprintf(stderr, "Window candidate size: %ld\n", wr_num_candidates());
 		}
 	}
+
+	vjf_release_thread();
+
+	__sync_fetch_and_add(&finished_threads, 1);
+
+	return NULL;
 }
 
 void dump_graph(dense_hash_map<const char*, struct node*, my_hash, eqstr>* nodes, const char* filename) {
@@ -1280,56 +1920,136 @@ void cleanup(dense_hash_map<const char*, struct node*, my_hash, eqstr>* nodes, s
 	}
 }
 
-#define MAX_ROOTS_PER_THREAD 5
+//
+// Root homology filter.  All roots are scored in parallel ahead of traversal.
+struct root_filter_batch {
+	vector<struct node*> roots;
+	vector<char> is_valid;
+	int next;
+};
 
-thread_info threads[100];
+void* root_filter_thread(void* arg) {
+	root_filter_batch* batch = (root_filter_batch*) arg;
 
-void process_roots(linked_node* root_nodes) {
+	int idx;
+	while ((idx = __sync_fetch_and_add(&batch->next, 1)) < batch->roots.size()) {
+		batch->is_valid[idx] = score_seq_cached(batch->roots[idx]->kmer, p.min_source_homology_score);
+	}
+
+	return NULL;
+}
+
+// Returns roots passing the homology filter, preserving order.  Filtered list entries are freed.
+struct linked_node* filter_roots(struct linked_node* root_nodes) {
 
-	// Initialize threads and root mutex
+	root_filter_batch batch;
+	batch.next = 0;
+	for (struct linked_node* root = root_nodes; root != NULL; root = root->next) {
+		batch.roots.push_back(root->node);
+	}
+	batch.is_valid.resize(batch.roots.size(), 0);
+
+	pthread_t filter_threads[100];
 	for (int i=0; i<p.threads; i++) {
-		pthread_mutex_init(&threads[i].mutex, NULL);
-		int ret = pthread_create(&threads[i].thread, NULL, worker_thread, &threads[i]);
+		int ret = pthread_create(&filter_threads[i], NULL, root_filter_thread, &batch);
 
 		if (ret != 0) {
-			fprintf(stderr, "Error creating thread 1: %d\n", ret);
-			fflush(stdout);
+			fprintf(stderr, "Error creating root filter thread: %d\n", ret);
 			exit(-1);
 		}
 	}
 
-	time_t te = 0;
-	time_t ts = 0;
-	int num_roots = 0;
-
-	while (root_nodes != NULL) {
-
-		char is_root_added = 0;
-		int i = 0;
-		while (!is_root_added && i < p.threads) {
-			pthread_mutex_lock(&threads[i].mutex);
-			if (threads[i].roots.size() < MAX_ROOTS_PER_THREAD) {
-				threads[i].roots.push(root_nodes->node);
-				is_root_added = 1;
-				num_roots++;
+	for (int i=0; i<p.threads; i++) {
+		pthread_join(filter_threads[i], NULL);
+	}
+
+	struct linked_node* filtered = NULL;
+	struct linked_node* last = NULL;
+	struct linked_node* root = root_nodes;
+	int num_valid = 0;
+
+	for (int i=0; i<batch.roots.size(); i++) {
+		struct linked_node* next = root->next;
+
+		if (batch.is_valid[i]) {
+			root->next = NULL;
+			if (last == NULL) {
+				filtered = root;
+			} else {
+				last->next = root;
 			}
-			pthread_mutex_unlock(&threads[i].mutex);
-			i++;
+			last = root;
+			num_valid++;
+		} else {
+			free(root);
 		}
 
-		if (!is_root_added) {
-			// All threads busy, sleep for 10 milliseconds
-			usleep(10*1000);
-			is_root_added = 0;
-		} else {
-			root_nodes = root_nodes->next;
+		root = next;
+	}
+
+	fprintf(stderr, "Roots passing homology filter: %d of %d\n", num_valid, (int) batch.roots.size());
+
+	return filtered;
+}
 
-			if ((num_roots % 100) == 0) {
-				fprintf(stderr, "Processed %d root nodes\n", num_roots);
-				fprintf(stderr, "Num candidate contigs: %d\n", vjf_windows.size());
-				fprintf(stderr, "Window candidate size: %d\n", vjf_window_candidates.size());
+pthread_t threads[100];
+
+void print_gate_rejects() {
+	long num_rejects = 0;
+	for (int i=0; i<REJECT_HIST_BINS; i++) {
+		num_rejects += gate_rejects[i];
+	}
+
+	fprintf(stderr, "Windows rejected during mapping: %ld, fully mapped: %ld\n", num_rejects, gate_mapped);
+	for (int i=0; i<REJECT_HIST_BINS; i++) {
+		if (gate_rejects[i] > 0 && i < REJECT_HIST_BINS-1) {
+			fprintf(stderr, "\trejected at %d-%d:\t%ld\n", i*REJECT_HIST_BIN+1, (i+1)*REJECT_HIST_BIN, gate_rejects[i]);
+		} else if (gate_rejects[i] > 0) {
+			fprintf(stderr, "\trejected at %d+:\t%ld\n", i*REJECT_HIST_BIN+1, gate_rejects[i]);
+		}
+	}
+}
+
+void process_roots(linked_node* root_nodes) {
+
+	root_work.clear();
+	next_root = 0;
+	finished_threads = 0;
+	for (struct linked_node* root = root_nodes; root != NULL; root = root->next) {
+		root_work.push_back(root->node);
+	}
+
+	// Start validation pool ahead of traversal threads
+	pthread_t* validators = NULL;
+	if (p.validation_threads > 0) {
+		vqueue_init(&vqueue, p.validation_queue_size);
+		validators = (pthread_t*) calloc(p.validation_threads, sizeof(pthread_t));
+		for (int i=0; i<p.validation_threads; i++) {
+			int ret = pthread_create(&validators[i], NULL, validation_thread, NULL);
+
+			if (ret != 0) {
+				fprintf(stderr, "Error creating validation thread: %d\n", ret);
+				exit(-1);
 			}
 		}
+	}
+
+	for (int i=0; i<p.threads; i++) {
+		int ret = pthread_create(&threads[i], NULL, worker_thread, NULL);
+
+		if (ret != 0) {
+			fprintf(stderr, "Error creating thread 1: %d\n", ret);
+			fflush(stdout);
+			exit(-1);
+		}
+	}
+
+	time_t te = 0;
+	time_t ts = 0;
+
+	// Wait for threads to work through the root list
+	while (finished_threads < p.threads) {
+		usleep(100*1000);
 
 		te = time(NULL);
 		if (te-ts > 300) {
@@ -1338,13 +2058,25 @@ void process_roots(linked_node* root_nodes) {
 		}
 	}
 
-	// Signal to threads that all roots have been processed and
-	// wait for them to finish.
-	all_roots_processed = 1;
-
 	for (int i=0; i<p.threads; i++) {
-		pthread_join(threads[i].thread, NULL);
+		pthread_join(threads[i], NULL);
+	}
+
+	// No more windows will be queued.  Drain the validation pool.
+	if (p.validation_threads > 0) {
+		vqueue_close(&vqueue);
+		for (int i=0; i<p.validation_threads; i++) {
+			pthread_join(validators[i], NULL);
+		}
+		vqueue_destroy(&vqueue);
+		free(validators);
 	}
+
+	fprintf(stderr, "Roots retried: %d, roots abandoned: %d\n", retried_roots, abandoned_roots);
+	fprintf(stderr, "Branches pruned by reachability index: %ld\n", pruned_branches);
+	vjf_print_arena_stats();
+	fprintf(stderr, "Window registry store: %ld bytes\n", wr_store_bytes());
+	print_gate_rejects();
 }
 
 char* assemble(const char* input,
@@ -1372,7 +2104,6 @@ char* assemble(const char* input,
 	fprintf(stderr, "Assembling: -> %s\n", output);
 
 	pthread_mutex_init(&running_thread_mutex, NULL);
-	pthread_mutex_init(&contig_writer_mutex, NULL);
 
 	struct linked_node* root_nodes = NULL;
 
@@ -1409,6 +2140,7 @@ char* assemble(const char* input,
 		print_status("POST_BUILD_GRAPH2");
 
 		root_nodes = identify_root_nodes(nodes);
+		root_nodes = filter_roots(root_nodes);
 
 		pre_nodes.clear();
 		pre_nodes.resize(0);
@@ -1434,6 +2166,9 @@ char* assemble(const char* input,
 	condense_graph(nodes);
 	fprintf(stderr, "Condense graph done\n");
 
+	build_reachability_index(nodes, pool);
+	compute_edge_scores(nodes);
+
 	print_status("POST_CONDENSE_GRAPH");
 
 	dump_graph(nodes, "vdjer.dot");
@@ -1445,14 +2180,12 @@ char* assemble(const char* input,
 	memset(contig_str, 0, MAX_TOTAL_CONTIG_LEN);
 
 	pthread_mutex_init(&running_thread_mutex, NULL);
-	pthread_mutex_init(&contig_writer_mutex, NULL);
 
 	process_roots(root_nodes);
 
 	print_status("THREADS_DONE");
 
 	pthread_mutex_destroy(&running_thread_mutex);
-	pthread_mutex_destroy(&contig_writer_mutex);
 
 	// Write windows to disk
 	fprintf(stderr, "Writing windows to disk\n");
@@ -1524,9 +2257,16 @@ int main(int argc, char* argv[]) {
 	// Initialize seq scoring for root node evalulation
 	score_seq_init(p.kmer, 1000, p.source_sim_file);
 
-	vjf_windows.set_empty_key(NULL);
-	vjf_windows.set_deleted_key(DELETED_KEY);
-	vjf_window_candidates.set_empty_key(NULL);
+	wr_init();
+	if (p.vj_index != NULL && access(p.vj_index, R_OK) == 0 && !vjf_load_anchor_index(p.vj_index)) {
+		fprintf(stderr, "Unable to load binary anchor index: %s\n", p.vj_index);
+		exit(-1);
+	}
+
+	if (p.anchor_seed_match) {
+		vjf_use_seed_matcher();
+	}
+
 	vjf_init(p.v_anchors, p.j_anchors, p.anchor_mismatches, p.vj_min_win, p.vj_max_win,
 			p.j_conserved, p.window_span, p.j_extension);
 
@@ -1536,6 +2276,7 @@ int main(int argc, char* argv[]) {
 	char* unaligned_input = NULL;
 	fprintf(stderr, "Extracting reads...\n");
 	fflush(stdout);
+	quick_map_set_max_mismatches(p.read_mismatches);
 	extract(p.input_bam, p.vdj_fasta, p.v_region, p.c_region, input, unaligned_input);
 	fprintf(stderr, "Read extract done...\n");
 	fflush(stdout);
@@ -15,6 +15,8 @@ using google::dense_hash_set;
 
 // quick_map3.c
 extern void quick_map_init();
+extern void quick_map_print_stats();
+extern void quick_map_build_seed_index();
 extern void add_read_info(char* read_id, char* seq, char* quals, char read_num, char is_rc);
 
 extern int kmer_size;
@@ -440,6 +442,9 @@ void extract(char* bam_file, char* vdj_fasta, char* v_region, char* c_region,
 	bam_destroy1(b);
 	bam_close(&bam);
 
+	quick_map_build_seed_index();
+	quick_map_print_stats();
+
 	kmer_size = orig_kmer_size;
 
 	free(extract_vdj_kmers_buf);
@@ -7,22 +7,93 @@
 
 using namespace std;
 
+//
+// Positions [start, end) checked by mate_coverage_is_valid for the given params.
+// If the coverage check passes, each of these positions is covered by at least floor mapped reads.
+// end <= start if no positions are checked.
+//
+void mate_coverage_region(int read_length, int eval_start, int eval_stop, int mate_span,
+		int insert_low, int insert_high, int& start, int& end) {
+
+	start = 0;
+	end = 0;
+
+	int pos = eval_start;
+	int mate_low = 0;
+	int mate_high = 0;
+
+	// Mirrors the position loop in mate_coverage_is_valid.  Checked intervals slide by one
+	// position per step, so their union is contiguous.
+	while (mate_low < eval_stop && pos < eval_stop) {
+		mate_low = pos + insert_low - read_length - mate_span/2;
+		mate_high = pos + insert_high - read_length + mate_span/2;
+
+		if (mate_high > eval_stop) {
+			mate_high = eval_stop+1;
+		}
+
+		if (mate_low < mate_high) {
+			if (end <= start) {
+				start = mate_low;
+			}
+			end = mate_high;
+		}
+
+		pos += 1;
+	}
+}
+
+//
+// Mate coverage check.  For each position pos in the eval region, mates of reads
+// overlapping pos must cover [mate_low, mate_high) at least floor deep.
+// Reads overlapping pos form a sliding window over start_positions (sorted by read start).
+// Mate coverage is updated as reads enter and leave the window rather than
+// being rebuilt per position.
+//
+// The floor check scans [mate_low, mate_high) per position, so it is O(L x W) for L eval
+// positions and W = mate_span + insert_high - insert_low.  W is small in practice, and
+// maintaining a below floor count instead costs more per mate update than the scan saves
+// (see coverage_bench.c).
+//
 char mate_coverage_is_valid(int read_length, int contig_len, int eval_start, int eval_stop, int mate_span,
 		               int insert_low, int insert_high, int floor, vector<mapped_pair>& mapped_reads,
 		               vector<pair<int,int> >& start_positions, char is_debug) {
 
 //s	floor = 1;
 	int num_reads = start_positions.size();
-	int begin_idx = 0;
 	int pos = eval_start;
 	char is_valid = 1;
 
 	int mate_low = 0;
 	int mate_high = 0;
 
+	// Reads in [leave_idx, enter_idx) overlap pos
+	int enter_idx = 0;
+	int leave_idx = 0;
+
+	vector<int> coverage(contig_len+1, 0);
+
 	while (mate_low < eval_stop && pos < eval_stop && is_valid) {
-		while(begin_idx<num_reads && start_positions[begin_idx].first+read_length-1 < pos) {
-			begin_idx += 1;
+		while (leave_idx < num_reads && start_positions[leave_idx].first+read_length-1 < pos) {
+			if (leave_idx < enter_idx) {
+				int* mate_coverage = &coverage[start_positions[leave_idx].second];
+				for (int i=0; i<read_length; i++) {
+					mate_coverage[i] -= 1;
+				}
+			}
+			leave_idx += 1;
+		}
+
+		if (enter_idx < leave_idx) {
+			enter_idx = leave_idx;
+		}
+
+		while (enter_idx < num_reads && start_positions[enter_idx].first <= pos) {
+			int* mate_coverage = &coverage[start_positions[enter_idx].second];
+			for (int i=0; i<read_length; i++) {
+				mate_coverage[i] += 1;
+			}
+			enter_idx += 1;
 		}
 
 //		mate_low = pos + insert_low - read_length - read_length/2;
@@ -35,17 +106,6 @@ char mate_coverage_is_valid(int read_length, int contig_len, int eval_start, int
 			mate_high = eval_stop+1;
 		}
 
-		int coverage[contig_len+1];
-		memset(coverage, 0, sizeof(int)*(contig_len+1));
-
-		int idx = begin_idx;
-		while (idx < num_reads && start_positions[idx].first <= pos) {
-			for (int i=0; i<read_length; i++) {
-				coverage[start_positions[idx].second+i] += 1;
-			}
-			idx += 1;
-		}
-
 		for (int j=mate_low; j<mate_high; j++) {
 			if (coverage[j] < floor) {
 				is_valid = 0;
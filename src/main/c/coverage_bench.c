@@ -0,0 +1,158 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <utility>
+#include <vector>
+#include <algorithm>
+#include "quick_map3.h"
+
+using namespace std;
+
+//
+// Microbenchmark of the mate coverage check in coverage.c.  Compares rebuilding mate
+// coverage from scratch for every eval position (as before coverage was tracked
+// incrementally) against the current mate_coverage_is_valid, on random mapping
+// layouts resembling validated windows.  Results of both are checked for agreement.
+//
+// Usage: coverage_bench [num_layouts]
+//
+
+#define READ_LEN 50
+#define CONTIG_LEN 360
+#define EVAL_START 52
+#define EVAL_STOP 359
+
+extern char mate_coverage_is_valid(int read_length, int contig_len, int eval_start, int eval_stop, int mate_span,
+		               int insert_low, int insert_high, int floor, vector<mapped_pair>& mapped_reads,
+		               vector<pair<int,int> >& start_positions, char is_debug);
+
+// Mate coverage check prior to incremental coverage tracking
+char rebuild_mate_coverage_is_valid(int read_length, int contig_len, int eval_start, int eval_stop, int mate_span,
+		               int insert_low, int insert_high, int floor, vector<mapped_pair>& mapped_reads,
+		               vector<pair<int,int> >& start_positions, char is_debug) {
+
+	int num_reads = start_positions.size();
+	int begin_idx = 0;
+	int pos = eval_start;
+	char is_valid = 1;
+
+	int mate_low = 0;
+	int mate_high = 0;
+
+	while (mate_low < eval_stop && pos < eval_stop && is_valid) {
+		while(begin_idx<num_reads && start_positions[begin_idx].first+read_length-1 < pos) {
+			begin_idx += 1;
+		}
+
+		mate_low = pos + insert_low - read_length - mate_span/2;
+		mate_high = pos + insert_high - read_length + mate_span/2;
+
+		if (mate_high > eval_stop) {
+			mate_high = eval_stop+1;
+		}
+
+		int coverage[contig_len+1];
+		memset(coverage, 0, sizeof(int)*(contig_len+1));
+
+		int idx = begin_idx;
+		while (idx < num_reads && start_positions[idx].first <= pos) {
+			for (int i=0; i<read_length; i++) {
+				coverage[start_positions[idx].second+i] += 1;
+			}
+			idx += 1;
+		}
+
+		for (int j=mate_low; j<mate_high; j++) {
+			if (coverage[j] < floor) {
+				is_valid = 0;
+				break;
+			}
+		}
+
+		pos += 1;
+	}
+
+	return is_valid;
+}
+
+struct layout {
+	vector<pair<int,int> > start_positions;
+	int floor;
+	int mate_span;
+	int insert_len;
+};
+
+// Read pairs with random starts and inserts, sorted by read start as in validate_window.
+// Most layouts are lightly covered.  Every 10th is deep.
+void random_layout(layout& l, int n) {
+	int num_pairs = rand() % (n % 10 == 0 ? 3000 : 200);
+
+	l.start_positions.clear();
+	for (int i=0; i<num_pairs; i++) {
+		int pos1 = 1 + rand() % (CONTIG_LEN-READ_LEN);
+		int insert = 120 + rand() % 160;
+		int pos2 = pos1 + insert - READ_LEN;
+		if (pos2 >= 1 && pos2 <= CONTIG_LEN-READ_LEN) {
+			l.start_positions.push_back(make_pair(pos1, pos2));
+			l.start_positions.push_back(make_pair(pos2, pos1));
+		}
+	}
+	sort(l.start_positions.begin(), l.start_positions.end());
+
+	l.floor = 1 + rand() % 3;
+	l.mate_span = rand() % 60;
+	l.insert_len = 150 + rand() % 50;
+}
+
+double elapsed_secs(struct timespec& start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+int main(int argc, char** argv) {
+	int num_layouts = argc > 1 ? atoi(argv[1]) : 20000;
+
+	srand(7);
+
+	vector<layout> layouts(num_layouts);
+	for (int i=0; i<num_layouts; i++) {
+		random_layout(layouts[i], i);
+	}
+
+	vector<mapped_pair> mapped_reads;
+	vector<char> rebuild_results(num_layouts);
+	vector<char> results(num_layouts);
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<num_layouts; i++) {
+		layout& l = layouts[i];
+		rebuild_results[i] = rebuild_mate_coverage_is_valid(READ_LEN, CONTIG_LEN, EVAL_START, EVAL_STOP, l.mate_span,
+				l.insert_len, l.insert_len, l.floor, mapped_reads, l.start_positions, 0);
+	}
+	double rebuild_secs = elapsed_secs(start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i=0; i<num_layouts; i++) {
+		layout& l = layouts[i];
+		results[i] = mate_coverage_is_valid(READ_LEN, CONTIG_LEN, EVAL_START, EVAL_STOP, l.mate_span,
+				l.insert_len, l.insert_len, l.floor, mapped_reads, l.start_positions, 0);
+	}
+	double secs = elapsed_secs(start);
+
+	int num_valid = 0;
+	int num_diff = 0;
+	for (int i=0; i<num_layouts; i++) {
+		num_valid += results[i];
+		num_diff += results[i] != rebuild_results[i];
+	}
+
+	printf("layouts: %d, valid: %d, mismatched results: %d\n", num_layouts, num_valid, num_diff);
+	printf("rebuild per position:\t%.3f secs\t%.2f us/layout\n", rebuild_secs, rebuild_secs * 1e6 / num_layouts);
+	printf("incremental:\t%.3f secs\t%.2f us/layout\n", secs, secs * 1e6 / num_layouts);
+	printf("speedup:\t%.2fx\n", rebuild_secs / secs);
+
+	return num_diff == 0 ? 0 : 1;
+}
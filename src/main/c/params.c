@@ -35,15 +35,28 @@ void set_chain_info(params* p, char* chain) {
 }
 
 void set_reference_info(params* p, char* ref_dir) {
-	p->v_anchors = (char*) calloc(4096, sizeof(char));
-	p->j_anchors = (char*) calloc(4096, sizeof(char));
 	p->vdj_fasta = (char*) calloc(4096, sizeof(char));
 	p->source_sim_file = (char*) calloc(4096, sizeof(char));
 
-	strcpy(p->v_anchors, ref_dir);
-	strcat(p->v_anchors, "/v_index");
-	strcpy(p->j_anchors, ref_dir);
-	strcat(p->j_anchors, "/j_index");
+	// Explicitly specified anchor files / index are not overridden
+	if (!p->v_anchors_set) {
+		p->v_anchors = (char*) calloc(4096, sizeof(char));
+		strcpy(p->v_anchors, ref_dir);
+		strcat(p->v_anchors, "/v_index");
+	}
+
+	if (!p->j_anchors_set) {
+		p->j_anchors = (char*) calloc(4096, sizeof(char));
+		strcpy(p->j_anchors, ref_dir);
+		strcat(p->j_anchors, "/j_index");
+	}
+
+	if (!p->vj_index_set) {
+		p->vj_index = (char*) calloc(4096, sizeof(char));
+		strcpy(p->vj_index, ref_dir);
+		strcat(p->vj_index, "/vj_index.bin");
+	}
+
 	strcpy(p->vdj_fasta, ref_dir);
 	strcat(p->vdj_fasta, "/ig_vdj.fa");
 	strcpy(p->source_sim_file, ref_dir);
@@ -59,6 +72,10 @@ void set_default_params(params* p) {
 	p->min_base_quality = 90;
 	p->min_contig_score = -5;
 	p->anchor_mismatches = 4;
+	p->anchor_seed_match = 0;
+	p->v_anchors_set = 0;
+	p->j_anchors_set = 0;
+	p->vj_index_set = 0;
 	p->window_span = 486;
 	p->j_extension = 162;
 	p->read_filter_floor = 1;
@@ -70,6 +87,14 @@ void set_default_params(params* p) {
 	p->eval_stop = 411;
 	p->threads = 1;
 	p->window_overlap_check_size = 320;
+	p->root_max_secs = 0;
+	p->root_max_paths = 500000000;
+	p->root_max_mem_mb = 0;
+	p->root_retries = 2;
+	p->validation_threads = 0;
+	p->validation_queue_size = 1024;
+	p->read_mismatches = 0;
+	p->quantify = 1;
 }
 void usage() {
 	fprintf(stderr, "vdjer \n");
@@ -81,6 +106,10 @@ void usage() {
 	fprintf(stderr, "\t--mcs <min contig score (default: -5)\n");
 	fprintf(stderr, "\t--t <threads (default: 1)\n");
 	fprintf(stderr, "\t--am <anchor mismatches (default: 4)\n");
+	fprintf(stderr, "\t--asm <1 to match anchors on the fly against germline anchors allowing --am mismatches (default: 0)>\n");
+	fprintf(stderr, "\t--vf <V anchor index file (default: <ref-dir>/v_index)>\n");
+	fprintf(stderr, "\t--jf <J anchor index file (default: <ref-dir>/j_index)>\n");
+	fprintf(stderr, "\t--vjb <binary V/J anchor index, used in place of --vf / --jf (default: <ref-dir>/vj_index.bin if present)>\n");
 	fprintf(stderr, "\t--miw <min window length between conserved amino acids>\n");
 	fprintf(stderr, "\t--maw <max window length between conserved amino acids>\n");
 	fprintf(stderr, "\t--jc <conserved J amino acid (W|F)\n");
@@ -98,6 +127,15 @@ void usage() {
 	fprintf(stderr, "\t--e0 <start position for contig filtering (default: 52)>\n");
 	fprintf(stderr, "\t--e1 <stop position for contig filtering (default: 411)>\n");
 	fprintf(stderr, "\t--wo <window overlap check size>\n");
+	fprintf(stderr, "\t--rmt <max wall time in seconds per root, 0 for no limit (default: 0)>\n");
+	fprintf(stderr, "\t--rmp <max paths per root (default: 500000000)>\n");
+	fprintf(stderr, "\t--rmm <max traversal memory in MB per root, 0 for no limit (default: 0)>\n");
+	fprintf(stderr, "\t--rr <number of stricter retries for roots exceeding budget (default: 2)>\n");
+	fprintf(stderr, "\t--vt <window validation threads, 0 to validate on traversal threads (default: 0)>\n");
+	fprintf(stderr, "\t--vq <max windows queued for validation (default: 1024)>\n");
+	fprintf(stderr, "\t--mm <max mismatches when mapping reads to contigs (default: 0)>\n");
+	fprintf(stderr, "\t--bam <write name sorted BAM to this file instead of SAM to stdout>\n");
+	fprintf(stderr, "\t--quant <1 to write contig abundance estimates to vdj_contigs.quant (default: 1)>\n");
 }
 
 void print_params(params* p) {
@@ -109,7 +147,11 @@ void print_params(params* p) {
 	fprintf(stderr, "%s\t%d\n", "num threads", p->threads);
 	fprintf(stderr, "%s\t%s\n", "v anchor file", p->v_anchors);
 	fprintf(stderr, "%s\t%s\n", "j anchor file", p->j_anchors);
+	// Binary V/J index built via seqd --compile.  Used in place of the text files when present.
+	fprintf(stderr, "%s\t%s\n", "binary anchor index", p->vj_index != NULL ? p->vj_index : "none");
 	fprintf(stderr, "%s\t%d\n", "max anchor mismatches:", p->anchor_mismatches);
+	// Pigeonhole seed matching against germline anchors.  Not limited by the radius of the expanded anchor index.
+	fprintf(stderr, "%s\t%d\n", "anchor seed matching", p->anchor_seed_match);
 	fprintf(stderr, "%s\t%d\n", "min V/J window", p->vj_min_win);
 	fprintf(stderr, "%s\t%d\n", "max V/J window", p->vj_max_win);
 	fprintf(stderr, "%s\t%d\n", "conserved J AA", p->j_conserved);
@@ -133,6 +175,20 @@ void print_params(params* p) {
 	fprintf(stderr, "%s\t%d\n", "stop point for contig filtering", p->eval_stop);
 	// Length of window to check for overlap.  Handles cases where multiple CDR3 windows are detected in similar contigs.
 	fprintf(stderr, "%s\t%d\n", "window overlap check size", p->window_overlap_check_size);
+	// Per root traversal budgets.  Roots exceeding a budget are retried with stricter settings or abandoned.
+	fprintf(stderr, "%s\t%d\n", "max secs per root", p->root_max_secs);
+	fprintf(stderr, "%s\t%ld\n", "max paths per root", p->root_max_paths);
+	fprintf(stderr, "%s\t%d\n", "max memory (MB) per root", p->root_max_mem_mb);
+	fprintf(stderr, "%s\t%d\n", "root retries", p->root_retries);
+	// Read mapping / coverage checks for candidate windows may run on a separate pool of threads.
+	fprintf(stderr, "%s\t%d\n", "validation threads", p->validation_threads);
+	fprintf(stderr, "%s\t%d\n", "validation queue size", p->validation_queue_size);
+	// Reads are mapped to windows and final contigs via exact match unless mismatches are allowed.
+	fprintf(stderr, "%s\t%d\n", "max read mismatches", p->read_mismatches);
+	// Final read mappings are written as SAM to stdout if no BAM file is specified.
+	fprintf(stderr, "%s\t%s\n", "BAM output", p->bam_output != NULL ? p->bam_output : "none");
+	// EM over pairs mapped to final contigs.  Pairs mapping to multiple contigs are split by abundance.
+	fprintf(stderr, "%s\t%d\n", "quantify contigs", p->quantify);
 }
 
 char file_exists(char* filename) {
@@ -151,34 +207,55 @@ void validate_params(params* p) {
 		ok = 0;
 	}
 
-	if (p->v_anchors == NULL) {
-		fprintf(stderr, "V anchor file must be specified\n");
+	// Explicit text anchor files and binary index are mutually exclusive.  Explicit text
+	// anchor files take precedence over the default ref-dir index.
+	if (p->vj_index_set && (p->v_anchors_set || p->j_anchors_set)) {
+		fprintf(stderr, "--vjb cannot be combined with --vf / --jf\n");
 		ok = 0;
-	} else if (!file_exists(p->v_anchors)) {
-		fprintf(stderr, "Could not locate v_index file: %s\n", p->v_anchors);
+	} else if (p->vj_index_set && !file_exists(p->vj_index)) {
+		fprintf(stderr, "Could not locate binary anchor index: %s\n", p->vj_index);
 		ok = 0;
+	} else if (p->v_anchors_set || p->j_anchors_set) {
+		p->vj_index = NULL;
 	}
 
-	if (p->j_anchors == NULL) {
-		fprintf(stderr, "J anchor file must be specified\n");
-		ok = 0;
-	} else if (!file_exists(p->j_anchors)) {
-		fprintf(stderr, "Could not locate j_index file: %s\n", p->j_anchors);
-		ok = 0;
+	// Text anchor files are only needed if there is no binary index
+	if (!p->vj_index_set && (p->vj_index == NULL || !file_exists(p->vj_index))) {
+		if (p->v_anchors == NULL) {
+			fprintf(stderr, "V anchor file must be specified\n");
+			ok = 0;
+		} else if (!file_exists(p->v_anchors)) {
+			fprintf(stderr, "Could not locate v_index file: %s\n", p->v_anchors);
+			ok = 0;
+		}
+
+		if (p->j_anchors == NULL) {
+			fprintf(stderr, "J anchor file must be specified\n");
+			ok = 0;
+		} else if (!file_exists(p->j_anchors)) {
+			fprintf(stderr, "Could not locate j_index file: %s\n", p->j_anchors);
+			ok = 0;
+		}
 	}
 
 	if (p->vdj_fasta == NULL) {
 		fprintf(stderr, "VDJ fasta file must be specified\n");
 		ok = 0;
-	} else if (!file_exists(p->j_anchors)) {
+	} else if (!file_exists(p->vdj_fasta)) {
 		fprintf(stderr, "Could not locate vdj_fasta file: %s\n", p->vdj_fasta);
 		ok = 0;
 	}
 
+	// V region seeds are packed into 32 bit codes
+	if (p->vregion_kmer_size < 1 || p->vregion_kmer_size > 16) {
+		fprintf(stderr, "V region kmer size must be between 1 and 16: %d\n", p->vregion_kmer_size);
+		ok = 0;
+	}
+
 	if (p->source_sim_file == NULL) {
 		fprintf(stderr, "source_sim_file file must be specified\n");
 		ok = 0;
-	} else if (!file_exists(p->j_anchors)) {
+	} else if (!file_exists(p->source_sim_file)) {
 		fprintf(stderr, "Could not locate source_sim_file file: %s\n", p->source_sim_file);
 		ok = 0;
 	}
@@ -203,6 +280,11 @@ void validate_params(params* p) {
 		ok = 0;
 	}
 
+	if (p->validation_threads > 0 && p->validation_queue_size <= 0) {
+		fprintf(stderr, "Validation queue size must be > 0\n");
+		ok = 0;
+	}
+
 	if (!ok) {
 		usage();
 		exit(-1);
@@ -215,6 +297,19 @@ char parse_params(int argc, char** argv, params* p) {
 
 	set_default_params(p);
 
+	// Recorded in the @PG header line of BAM output
+	int cl_len = 0;
+	for (int i=0; i<argc; i++) {
+		cl_len += strlen(argv[i]) + 1;
+	}
+	p->command_line = (char*) calloc(cl_len+1, sizeof(char));
+	for (int i=0; i<argc; i++) {
+		if (i > 0) {
+			strcat(p->command_line, " ");
+		}
+		strcat(p->command_line, argv[i]);
+	}
+
 	for (int i=1; i<argc; i+=2) {
 		char* param = argv[i];
 
@@ -247,8 +342,15 @@ char parse_params(int argc, char** argv, params* p) {
 			p->threads = atoi(value);
 		} else if (!strcmp(param, "--vf")) {
 			p->v_anchors = value;
+			p->v_anchors_set = 1;
 		} else if (!strcmp(param, "--jf")) {
 			p->j_anchors = value;
+			p->j_anchors_set = 1;
+		} else if (!strcmp(param, "--asm")) {
+			p->anchor_seed_match = atoi(value);
+		} else if (!strcmp(param, "--vjb")) {
+			p->vj_index = value;
+			p->vj_index_set = 1;
 		} else if (!strcmp(param, "--am")) {
 			p->anchor_mismatches = atoi(value);
 		} else if (!strcmp(param, "--miw")) {
@@ -289,6 +391,24 @@ char parse_params(int argc, char** argv, params* p) {
 			p->eval_stop = atoi(value);
 		} else if (!strcmp(param, "--wo")) {
 			p->window_overlap_check_size = atoi(value);
+		} else if (!strcmp(param, "--rmt")) {
+			p->root_max_secs = atoi(value);
+		} else if (!strcmp(param, "--rmp")) {
+			p->root_max_paths = atol(value);
+		} else if (!strcmp(param, "--rmm")) {
+			p->root_max_mem_mb = atoi(value);
+		} else if (!strcmp(param, "--rr")) {
+			p->root_retries = atoi(value);
+		} else if (!strcmp(param, "--vt")) {
+			p->validation_threads = atoi(value);
+		} else if (!strcmp(param, "--vq")) {
+			p->validation_queue_size = atoi(value);
+		} else if (!strcmp(param, "--mm")) {
+			p->read_mismatches = atoi(value);
+		} else if (!strcmp(param, "--bam")) {
+			p->bam_output = value;
+		} else if (!strcmp(param, "--quant")) {
+			p->quantify = atoi(value);
 		} else {
 			fprintf(stderr, "Invalid param: %s\n", param);
 		}
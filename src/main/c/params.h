@@ -9,7 +9,13 @@ struct params {
 	int threads;
 	char* v_anchors;
 	char* j_anchors;
+	char* vj_index;
+	// Set if anchor files / binary index were given on the command line rather than via ref-dir
+	int v_anchors_set;
+	int j_anchors_set;
+	int vj_index_set;
 	int anchor_mismatches;
+	int anchor_seed_match;
 	int vj_min_win;
 	int vj_max_win;
 	int j_conserved;
@@ -29,6 +35,16 @@ struct params {
 	int eval_start;
 	int eval_stop;
 	int window_overlap_check_size;
+	int root_max_secs;
+	long root_max_paths;
+	int root_max_mem_mb;
+	int root_retries;
+	int validation_threads;
+	int validation_queue_size;
+	int read_mismatches;
+	char* bam_output;
+	int quantify;
+	char* command_line;
 };
 
 char parse_params(int argc, char** argv, params* p);
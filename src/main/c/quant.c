@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+#include "quick_map3.h"
+
+using namespace std;
+
+//
+// Abundance estimation for the final contigs.  Read pairs mapped to contigs are
+// assigned via expectation maximization, splitting pairs that map to multiple
+// contigs / positions in proportion to current abundance estimates.
+//
+// The likelihood of an alignment with insert length f on a contig of length L is
+// P(f) / (L-f+1), where P(f) is the empirical insert length distribution of
+// uniquely mapped pairs, truncated to inserts that fit within the contig.
+// Effective contig length is the expected number of start positions under P(f).
+//
+
+#define MAX_EM_ITERATIONS 1000
+
+// Stop once no contig's abundance changes by more than this relative amount
+#define EM_CONVERGENCE 1e-6
+
+// Abundances below this are not considered when checking convergence
+#define EM_MIN_ABUNDANCE 1e-8
+
+// Added to each insert length bin so that unobserved lengths are possible
+#define INSERT_PSEUDOCOUNT 0.01
+
+struct alignment {
+	int pair_id;
+	int contig;
+	short insert;
+	double weight;  // P(alignment | contig)
+};
+
+bool compare_alignments(const alignment& a1, const alignment& a2) {
+	return a1.pair_id < a2.pair_id;
+}
+
+// Empirical insert length distribution indexed by insert length.
+// alignments must be grouped by pair.
+void insert_distribution(vector<alignment>& alignments, int max_insert, vector<double>& dist) {
+
+	dist.assign(max_insert+1, 0);
+
+	// Use uniquely mapped pairs where available
+	int num_unique = 0;
+	for (int i=0; i<alignments.size(); i++) {
+		char is_unique = (i == 0 || alignments[i-1].pair_id != alignments[i].pair_id) &&
+				(i+1 == alignments.size() || alignments[i+1].pair_id != alignments[i].pair_id);
+		if (is_unique) {
+			dist[alignments[i].insert] += 1;
+			num_unique++;
+		}
+	}
+
+	if (num_unique == 0) {
+		for (int i=0; i<alignments.size(); i++) {
+			dist[alignments[i].insert] += 1;
+		}
+	}
+
+	double total = 0;
+	for (int f=1; f<=max_insert; f++) {
+		dist[f] += INSERT_PSEUDOCOUNT;
+		total += dist[f];
+	}
+
+	for (int f=1; f<=max_insert; f++) {
+		dist[f] /= total;
+	}
+}
+
+void quantify_contigs(vector<sam_contig>& contigs, const char* output_file) {
+
+	int num_contigs = contigs.size();
+
+	// Collect alignments grouped by read pair
+	vector<alignment> alignments;
+	int max_insert = 0;
+	for (int c=0; c<num_contigs; c++) {
+		for (int i=0; i<contigs[c].num_mappings; i++) {
+			alignment a;
+			a.pair_id = contigs[c].mappings[i].r1->pair_id;
+			a.contig = c;
+			a.insert = contigs[c].mappings[i].insert;
+			alignments.push_back(a);
+			max_insert = max(max_insert, (int) a.insert);
+		}
+	}
+	stable_sort(alignments.begin(), alignments.end(), compare_alignments);
+
+	vector<double> insert_dist;
+	insert_distribution(alignments, max_insert, insert_dist);
+
+	// Effective lengths and the truncated insert distribution mass per contig
+	vector<int> lengths(num_contigs);
+	vector<double> eff_lengths(num_contigs);
+	vector<double> insert_mass(num_contigs);
+	for (int c=0; c<num_contigs; c++) {
+		lengths[c] = strlen(contigs[c].seq);
+		double mass = 0;
+		double positions = 0;
+		for (int f=1; f<=max_insert && f<=lengths[c]; f++) {
+			mass += insert_dist[f];
+			positions += insert_dist[f] * (lengths[c]-f+1);
+		}
+		insert_mass[c] = mass;
+		eff_lengths[c] = mass > 0 ? positions / mass : 0;
+	}
+
+	for (int i=0; i<alignments.size(); i++) {
+		alignment& a = alignments[i];
+		a.weight = insert_dist[a.insert] / insert_mass[a.contig] / (lengths[a.contig] - a.insert + 1);
+	}
+
+	// Start of each pair's alignments, plus an end marker
+	vector<int> pair_starts;
+	for (int i=0; i<alignments.size(); i++) {
+		if (i == 0 || alignments[i-1].pair_id != alignments[i].pair_id) {
+			pair_starts.push_back(i);
+		}
+	}
+	int num_pairs = pair_starts.size();
+	pair_starts.push_back(alignments.size());
+
+	// Fraction of pairs originating from each contig
+	vector<double> abundance(num_contigs, num_contigs > 0 ? 1.0 / num_contigs : 0);
+	vector<double> counts(num_contigs);
+	vector<double> probs;
+
+	int iter;
+	for (iter=1; iter<=MAX_EM_ITERATIONS && num_pairs > 0; iter++) {
+
+		// E step: expected pair counts per contig
+		fill(counts.begin(), counts.end(), 0);
+		for (int p=0; p<num_pairs; p++) {
+			int start = pair_starts[p];
+			int end = pair_starts[p+1];
+
+			double total = 0;
+			probs.resize(end-start);
+			for (int i=start; i<end; i++) {
+				probs[i-start] = abundance[alignments[i].contig] * alignments[i].weight;
+				total += probs[i-start];
+			}
+
+			if (total > 0) {
+				for (int i=start; i<end; i++) {
+					counts[alignments[i].contig] += probs[i-start] / total;
+				}
+			}
+		}
+
+		// M step
+		double max_change = 0;
+		for (int c=0; c<num_contigs; c++) {
+			double updated = counts[c] / num_pairs;
+			if (updated > EM_MIN_ABUNDANCE) {
+				max_change = max(max_change, fabs(updated - abundance[c]) / updated);
+			}
+			abundance[c] = updated;
+		}
+
+		if (max_change < EM_CONVERGENCE) {
+			break;
+		}
+	}
+
+	fprintf(stderr, "Quantified %d read pairs across %d contigs in %d EM iterations\n",
+			num_pairs, num_contigs, min(iter, MAX_EM_ITERATIONS));
+
+	// TPM from per base pair rates
+	double total_rate = 0;
+	for (int c=0; c<num_contigs; c++) {
+		if (eff_lengths[c] > 0) {
+			total_rate += counts[c] / eff_lengths[c];
+		}
+	}
+
+	FILE* fp = fopen(output_file, "w");
+	if (fp == NULL) {
+		fprintf(stderr, "Unable to open quantification output file: %s\n", output_file);
+		exit(-1);
+	}
+
+	fprintf(fp, "contig_id\tlength\teffective_length\texpected_count\tTPM\n");
+	for (int c=0; c<num_contigs; c++) {
+		double tpm = total_rate > 0 && eff_lengths[c] > 0 ? counts[c] / eff_lengths[c] / total_rate * 1e6 : 0;
+		fprintf(fp, "%s\t%d\t%.2f\t%.2f\t%.2f\n", contigs[c].id, lengths[c], eff_lengths[c], counts[c], tpm);
+	}
+
+	fclose(fp);
+}
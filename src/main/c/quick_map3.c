@@ -1,17 +1,22 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 #include <time.h>
+#include <pthread.h>
 #include <algorithm>
+#include <string>
 #include <utility>
-#include <sparsehash/sparse_hash_map>
+#include <vector>
+#include <sparsehash/dense_hash_map>
 
+#include "htslib/sam.h"
 #include "hash_utils.h"
 #include "quick_map3.h"
 
 using namespace std;
 
-using google::sparse_hash_map;
+using google::dense_hash_map;
 
 //int READ_LEN = 50;
 //int MIN_INSERT = 180 - 60; // 120
@@ -23,25 +28,6 @@ int READ_LEN = 0;
 int MIN_INSERT = 50;
 int MAX_INSERT = 400;
 
-//
-// String comparison bounded at READ_LEN
-struct qm_eqstr
-{
-  bool operator()(const char* s1, const char* s2) const
-  {
-    return (s1 == s2) || (s1 && s2 && strncmp(s1, s2, READ_LEN) == 0);
-  }
-};
-
-//
-// String hash bounded at READ_LEN
-struct qm_hash
-{
-	uint64_t operator()(const char* seq) const
-	{
-		return MurmurHash64A(seq, READ_LEN, 97);
-	}
-};
 
 // Allocate 1GB at a time
 #define READ_BLOCK 1000000000
@@ -53,16 +39,246 @@ char* qual_buf_start;
 
 #define MAX_LINE 1024
 #define MAX_CONTIG_LEN 10000
+#define SAM_LINE_LEN 4096
+
+//
+// Open addressing read table.  Reads are keyed by a polynomial rolling hash of their
+// 2 bit encoded bases so that a contig can be scanned updating the hash in O(1) per
+// base.  Slots store the full hash, so most non matching probes are rejected without
+// touching the read.  Hits are verified against the full read sequence.
+// Reads containing ambiguous bases are not indexed.
+//
+struct read_slot {
+	uint64_t hash;
+	read_vec* reads;  // NULL for empty slots
+};
+
+#define HASH_BASE 0x9E3779B97F4A7C15ULL
+#define INIT_READ_TABLE_SIZE (1 << 16)
+
+// Contig positions hashed and prefetched per batch
+#define PROBE_BATCH 16
 
+read_slot* read_table = NULL;
+uint64_t read_table_mask = 0;
+long num_distinct_reads = 0;
+long num_ambiguous_reads = 0;
+
+// HASH_BASE^(READ_LEN-1) for removing the outgoing base
+uint64_t hash_base_pow = 1;
+
+signed char qm_base_vals[256];
+
+//
+// Pigeonhole seed index for mismatch tolerant mapping.  Reads are split into
+// max_mismatches+1 segments, so a read within max_mismatches of a contig position
+// matches the contig exactly in at least one segment.  For each segment, entries
+// are sorted by segment hash with a hash -> entry range directory.
+// Candidates are verified by counting mismatches over the full read.
 //
-// Key = read sequence, Value = vector of read_info
-sparse_hash_map<const char*, struct read_vec*, qm_hash, qm_eqstr>* reads = new sparse_hash_map<const char*, struct read_vec*, qm_hash, qm_eqstr>();
+#define MAX_SEGMENTS 8
+
+struct seed_entry {
+	uint64_t hash;
+	read_vec* reads;
+};
+
+bool compare_seed_entries(const seed_entry& e1, const seed_entry& e2) {
+	return e1.hash < e2.hash;
+}
+
+struct seed_segment {
+	int offset;
+	int len;
+	uint64_t base_pow;  // HASH_BASE^(len-1)
+	vector<seed_entry> entries;
+	dense_hash_map<uint64_t, pair<int,int> > ranges;
+};
+
+int max_mismatches = 0;
+int num_segments = 0;
+seed_segment segments[MAX_SEGMENTS];
+
+//
+// Integer ids for read pairs.  Read ids are keyed by name.
+dense_hash_map<const char*, int, vjf_hash, vjf_eqstr>* pair_ids = new dense_hash_map<const char*, int, vjf_hash, vjf_eqstr>();
+
+//
+// Per thread mapping state.  Reused across contigs.
+struct quick_map_ctx {
+	vector<map_info> read1;
+	vector<map_info> read2;
+	// Rolling segment hash and validity by contig position for each seed segment
+	vector<uint64_t> seg_hashes[MAX_SEGMENTS];
+	vector<char> seg_valid[MAX_SEGMENTS];
+	// pair id -> indices of first and last read 2 hits in read2
+	dense_hash_map<int, pair<int,int> > mates;
+};
+
+static __thread quick_map_ctx* qm_ctx = NULL;
 
 void quick_map_init() {
 	READ_LEN = read_length;
-	reads->set_deleted_key(NULL);
+	pair_ids->set_empty_key(NULL);
+
+	memset(qm_base_vals, -1, sizeof(qm_base_vals));
+	qm_base_vals['A'] = 0;
+	qm_base_vals['C'] = 1;
+	qm_base_vals['G'] = 2;
+	qm_base_vals['T'] = 3;
+
+	hash_base_pow = 1;
+	for (int i=0; i<READ_LEN-1; i++) {
+		hash_base_pow *= HASH_BASE;
+	}
+
+	read_table = (read_slot*) calloc(INIT_READ_TABLE_SIZE, sizeof(read_slot));
+	read_table_mask = INIT_READ_TABLE_SIZE-1;
+}
+
+// Murmur3 finalizer.  Spreads rolling hash bits across the slot index.
+static inline uint64_t slot_index(uint64_t hash) {
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+	hash *= 0xc4ceb9fe1a85ec53ULL;
+	hash ^= hash >> 33;
+	return hash & read_table_mask;
+}
+
+// Hash of len bases starting at seq.  Returns false if an ambiguous base is found.
+char seq_hash(const char* seq, int len, uint64_t& hash) {
+	hash = 0;
+	for (int i=0; i<len; i++) {
+		int val = qm_base_vals[(unsigned char) seq[i]];
+		if (val < 0) {
+			return false;
+		}
+		hash = hash * HASH_BASE + val;
+	}
+
+	return true;
+}
+
+// Returns false if seq contains an ambiguous base within READ_LEN
+char read_hash(const char* seq, uint64_t& hash) {
+	return seq_hash(seq, READ_LEN, hash);
+}
+
+read_vec* find_read(uint64_t hash, const char* seq) {
+	uint64_t idx = slot_index(hash);
+	while (read_table[idx].reads != NULL) {
+		if (read_table[idx].hash == hash && memcmp(read_table[idx].reads->seq, seq, READ_LEN) == 0) {
+			return read_table[idx].reads;
+		}
+		idx = (idx+1) & read_table_mask;
+	}
+
+	return NULL;
+}
+
+void insert_read(uint64_t hash, read_vec* reads) {
+	uint64_t idx = slot_index(hash);
+	while (read_table[idx].reads != NULL) {
+		idx = (idx+1) & read_table_mask;
+	}
+
+	read_table[idx].hash = hash;
+	read_table[idx].reads = reads;
+}
+
+// Double the table size, keeping load at or below 1/2
+void grow_read_table() {
+	read_slot* old_table = read_table;
+	uint64_t old_size = read_table_mask+1;
+
+	read_table = (read_slot*) calloc(old_size*2, sizeof(read_slot));
+	if (read_table == NULL) {
+		fprintf(stderr, "Unable to allocate read table\n");
+		exit(-1);
+	}
+	read_table_mask = old_size*2-1;
+
+	for (uint64_t i=0; i<old_size; i++) {
+		if (old_table[i].reads != NULL) {
+			insert_read(old_table[i].hash, old_table[i].reads);
+		}
+	}
+
+	free(old_table);
+}
+
+void quick_map_set_max_mismatches(int mismatches) {
+	if (mismatches < 0 || mismatches >= MAX_SEGMENTS) {
+		fprintf(stderr, "Max read mismatches must be between 0 and %d\n", MAX_SEGMENTS-1);
+		exit(-1);
+	}
+	max_mismatches = mismatches;
 }
 
+void quick_map_build_seed_index() {
+	if (max_mismatches == 0) {
+		return;
+	}
+
+	num_segments = max_mismatches+1;
+	if (READ_LEN / num_segments < 8) {
+		fprintf(stderr, "Read length %d too short for %d mismatches\n", READ_LEN, max_mismatches);
+		exit(-1);
+	}
+
+	int offset = 0;
+	for (int s=0; s<num_segments; s++) {
+		seed_segment& segment = segments[s];
+		segment.offset = offset;
+		segment.len = READ_LEN / num_segments + (s < READ_LEN % num_segments ? 1 : 0);
+		offset += segment.len;
+
+		segment.base_pow = 1;
+		for (int i=0; i<segment.len-1; i++) {
+			segment.base_pow *= HASH_BASE;
+		}
+
+		segment.entries.reserve(num_distinct_reads);
+		for (uint64_t i=0; i<=read_table_mask; i++) {
+			if (read_table[i].reads != NULL) {
+				seed_entry entry;
+				seq_hash(read_table[i].reads->seq + segment.offset, segment.len, entry.hash);
+				entry.reads = read_table[i].reads;
+				segment.entries.push_back(entry);
+			}
+		}
+
+		sort(segment.entries.begin(), segment.entries.end(), compare_seed_entries);
+
+		segment.ranges.set_empty_key(0xFFFFFFFFFFFFFFFFULL);
+		int start = 0;
+		for (int i=1; i<=segment.entries.size(); i++) {
+			if (i == segment.entries.size() || segment.entries[i].hash != segment.entries[start].hash) {
+				segment.ranges[segment.entries[start].hash] = make_pair(start, i);
+				start = i;
+			}
+		}
+	}
+
+	fprintf(stderr, "Read seed index: %d segments, max mismatches: %d\n", num_segments, max_mismatches);
+}
+
+void quick_map_print_stats() {
+	fprintf(stderr, "Read table: %ld distinct reads, %ld slots, %ld reads with ambiguous bases not indexed\n",
+			num_distinct_reads, read_table_mask+1, num_ambiguous_reads);
+}
+
+quick_map_ctx* get_quick_map_ctx() {
+	if (qm_ctx == NULL) {
+		qm_ctx = new quick_map_ctx();
+		qm_ctx->mates.set_empty_key(-1);
+	}
+
+	return qm_ctx;
+}
+
+
 void advance_read_buf() {
 	// Advance read buffer to next open slot (TODO: Better to stay on word boundary?)
 	read_buf = read_buf + strlen(read_buf) + 1;
@@ -123,21 +339,44 @@ int reverse(char* input, char* output) {
 }
 */
 
+int get_pair_id(char* read_id) {
+	dense_hash_map<const char*, int, vjf_hash, vjf_eqstr>::const_iterator it = pair_ids->find(read_id);
+	if (it != pair_ids->end()) {
+		return it->second;
+	}
+
+	int pair_id = pair_ids->size();
+	(*pair_ids)[read_id] = pair_id;
+	return pair_id;
+}
+
 void add_read_info(char* read_id, char* seq, char* quals, char read_num, char is_rc) {
 
-	read_vec* seq_reads = (*reads)[seq];
+	uint64_t hash;
+	if (!read_hash(seq, hash)) {
+		num_ambiguous_reads++;
+		return;
+	}
+
+	read_vec* seq_reads = find_read(hash, seq);
 
-	// No hit in hash map.  Add new entry
+	// No hit in hash table.  Add new entry
 	if (seq_reads == NULL) {
 		seq_reads = (read_vec*) calloc(1, sizeof(read_vec));
 		seq_reads->reads = new vector<read_info*>();
 		seq_reads->seq = seq;
-		(*reads)[seq] = seq_reads;
+
+		if ((num_distinct_reads+1)*2 > read_table_mask+1) {
+			grow_read_table();
+		}
+		insert_read(hash, seq_reads);
+		num_distinct_reads++;
 	}
 
 	read_info* read_info1 = (read_info*) calloc(1, sizeof(read_info));
 
 	read_info1->id = read_id;
+	read_info1->pair_id = get_pair_id(read_id);
 	read_info1->read_num = read_num;
 	read_info1->is_rc = is_rc;
 	read_info1->seq = seq_reads->seq;
@@ -149,81 +388,303 @@ void add_read_info(char* read_id, char* seq, char* quals, char read_num, char is
 }
 
 //TODO: Output base qualities
-void output_mapping(char* contig_id, map_info* r1, map_info* r2, int insert) {
+void output_mapping(string& out, const char* contig_id, const pair_mapping& mapping) {
 
+	read_info* r1 = mapping.r1;
+	read_info* r2 = mapping.r2;
 	char* read_id;
 
-	if (r1->info->id[0] == '@') {
-		read_id = &(r1->info->id[1]);
+	if (r1->id[0] == '@') {
+		read_id = &(r1->id[1]);
 	} else {
-		read_id = r1->info->id;
+		read_id = r1->id;
 	}
 
-	int flag1 = 0x1l | 0x2 |  (r1->info->is_rc ? 0x10 : 0x20) | 0x40;
-	int flag2 = 0x1l | 0x2 |  (r2->info->is_rc ? 0x10 : 0x20) | 0x80;
-
-	char seq[256];
-	char quals[256];
+	int flag1 = 0x1l | 0x2 |  (r1->is_rc ? 0x10 : 0x20) | 0x40;
+	int flag2 = 0x1l | 0x2 |  (r2->is_rc ? 0x10 : 0x20) | 0x80;
 
-	const char* format = "%s\t%d\t%s\t%d\t255\t%dM\t=\t%d\t%d\t%s\t%s\n";
+	char line[SAM_LINE_LEN];
 
-	// Only need to add null terminators once.
-	seq[READ_LEN] = '\0';
-	quals[READ_LEN] = '\0';
+	// Edit distance is only reported when mismatches are allowed
+	const char* format = max_mismatches > 0 ?
+			"%s\t%d\t%s\t%d\t255\t%dM\t=\t%d\t%d\t%.*s\t%.*s\tNM:i:%d\n" :
+			"%s\t%d\t%s\t%d\t255\t%dM\t=\t%d\t%d\t%.*s\t%.*s\n";
 
-	strncpy(seq, r1->info->seq, READ_LEN);
-	strncpy(quals, r1->info->quals, READ_LEN);
-	printf(format, read_id, flag1, contig_id, r1->pos, READ_LEN, r2->pos, insert, seq, quals);
+	int len = snprintf(line, SAM_LINE_LEN, format, read_id, flag1, contig_id, mapping.pos1, READ_LEN, mapping.pos2,
+			mapping.insert, READ_LEN, r1->seq, READ_LEN, r1->quals, mapping.mismatches1);
+	out.append(line, min(len, SAM_LINE_LEN-1));
 
-	strncpy(seq, r2->info->seq, READ_LEN);
-	strncpy(quals, r2->info->quals, READ_LEN);
-	printf(format, read_id, flag2, contig_id, r2->pos, READ_LEN, r1->pos, insert, seq, quals);
+	len = snprintf(line, SAM_LINE_LEN, format, read_id, flag2, contig_id, mapping.pos2, READ_LEN, mapping.pos1,
+			mapping.insert, READ_LEN, r2->seq, READ_LEN, r2->quals, mapping.mismatches2);
+	out.append(line, min(len, SAM_LINE_LEN-1));
 }
 
-char contains_read(char* read) {
-	sparse_hash_map<const char*, struct read_vec*, qm_hash, qm_eqstr>::const_iterator it = reads->find(read);
-	return it != reads->end();
+//
+// Add hits for all reads with sequence read_v at contig position pos (1 based).
+// Read 1 hits are stored in a vector.  Read 2 hits are stored in a vector, chaining hits for the same pair.
+void add_hits(quick_map_ctx* ctx, read_vec* read_v, int pos, int mismatches) {
+	for (vector<read_info*>::iterator it = read_v->reads->begin(); it != read_v->reads->end(); ++it) {
+		read_info* r_info = *it;
+
+		map_info m_info;
+		m_info.info = r_info;
+		m_info.pos = pos;
+		m_info.mismatches = mismatches;
+		m_info.next_mate = -1;
+
+		if (r_info->read_num == 1) {
+			ctx->read1.push_back(m_info);
+		} else {
+			int idx = ctx->read2.size();
+			ctx->read2.push_back(m_info);
+
+			dense_hash_map<int, pair<int,int> >::iterator mate = ctx->mates.find(r_info->pair_id);
+			if (mate == ctx->mates.end()) {
+				ctx->mates[r_info->pair_id] = make_pair(idx, idx);
+			} else {
+				ctx->read2[mate->second.second].next_mate = idx;
+				mate->second.second = idx;
+			}
+		}
+	}
 }
 
-void quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>& mapped_reads,
-		vector<pair<int, int> >& start_positions, char should_output) {
+//
+// Return false if position pos (1 based) must be covered but the most recent read
+// hit starting at or before pos does not reach it.
+static inline char gate_passes(coverage_gate* gate, int last_hit_pos, int pos) {
+	if (gate == NULL || pos < gate->cover_start || pos >= gate->cover_end) {
+		return 1;
+	}
+
+	if (last_hit_pos > 0 && last_hit_pos + READ_LEN > pos) {
+		return 1;
+	}
 
-	int read1_count = 0;
-	// TODO: Grow dynamically
-	int MAX_READ_PAIRS = 10000000;
-	map_info** read1 = (map_info**) calloc(MAX_READ_PAIRS, sizeof(map_info*));
+	gate->reject_pos = pos;
+	return 0;
+}
 
-	sparse_hash_map<const char*, struct map_info*, vjf_hash, vjf_eqstr> read2;
+// Check gated positions beyond the last mappable position
+static inline char gate_passes_tail(coverage_gate* gate, int last_hit_pos, int num_positions) {
+	if (gate == NULL) {
+		return 1;
+	}
 
-	// Load read 1 matches into vector
-	// Load read 2 matches into map
-	for (int i=0; i<strlen(contig)-READ_LEN; i++) {
-		if (contains_read(contig+i)) {
-			read_vec* read_v = (*reads)[contig+i];
-			for (vector<read_info*>::iterator it = read_v->reads->begin(); it != read_v->reads->end(); ++it) {
-				read_info* r_info = *it;
+	for (int pos=max(num_positions+1, gate->cover_start); pos<gate->cover_end; pos++) {
+		if (!gate_passes(gate, last_hit_pos, pos)) {
+			return 0;
+		}
+	}
 
-				map_info* m_info = (map_info*) calloc(1, sizeof(map_info));
-				m_info->info = r_info;
-				m_info->pos = i + 1;
+	return 1;
+}
 
-				if (r_info->read_num == 1) {
-					read1[read1_count++] = m_info;
+//
+// Find reads matching the contig exactly.  Returns false if rejected by gate.
+char exact_map_contig(quick_map_ctx* ctx, const char* contig, int num_positions, coverage_gate* gate) {
+	// Positions are hashed a batch at a time with table slots prefetched ahead of the probes.
+	// Positions overlapping an ambiguous base are skipped.
+	uint64_t hashes[PROBE_BATCH];
+	char is_valid[PROBE_BATCH];
+
+	uint64_t hash = 0;
+	int valid_bases = 0;
+	int next_base = 0;
+	int last_hit_pos = 0;
+
+	for (int batch=0; batch<num_positions; batch+=PROBE_BATCH) {
+		int batch_size = min(PROBE_BATCH, num_positions-batch);
+
+		for (int b=0; b<batch_size; b++) {
+			int i = batch+b;
+
+			// Advance hash to cover contig[i, i+READ_LEN)
+			while (next_base < i+READ_LEN) {
+				int val = qm_base_vals[(unsigned char) contig[next_base]];
+				if (val < 0) {
+					hash = 0;
+					valid_bases = 0;
 				} else {
-					// TODO: Handle read 2 multi-mappers
-					read2[r_info->id] = m_info;
+					if (valid_bases >= READ_LEN) {
+						int out_val = qm_base_vals[(unsigned char) contig[next_base-READ_LEN]];
+						hash -= out_val * hash_base_pow;
+					}
+					hash = hash * HASH_BASE + val;
+					valid_bases++;
+				}
+				next_base++;
+			}
+
+			hashes[b] = hash;
+			is_valid[b] = valid_bases >= READ_LEN;
+			if (is_valid[b]) {
+				__builtin_prefetch(&read_table[slot_index(hash)]);
+			}
+		}
+
+		for (int b=0; b<batch_size; b++) {
+			int i = batch+b;
+
+			if (is_valid[b]) {
+				read_vec* read_v = find_read(hashes[b], contig+i);
+				if (read_v != NULL) {
+					add_hits(ctx, read_v, i+1, 0);
+					last_hit_pos = i+1;
+				}
+			}
+
+			if (!gate_passes(gate, last_hit_pos, i+1)) {
+				return 0;
+			}
+		}
+	}
+
+	return gate_passes_tail(gate, last_hit_pos, num_positions);
+}
+
+// Rolling hashes of the len base windows starting at each contig position
+void rolling_hashes(const char* contig, int contig_len, int len, uint64_t base_pow,
+		vector<uint64_t>& hashes, vector<char>& is_valid) {
+
+	hashes.resize(contig_len);
+	is_valid.assign(contig_len, 0);
+
+	uint64_t hash = 0;
+	int valid_bases = 0;
+	for (int i=0; i<contig_len; i++) {
+		int val = qm_base_vals[(unsigned char) contig[i]];
+		if (val < 0) {
+			hash = 0;
+			valid_bases = 0;
+			continue;
+		}
+
+		if (valid_bases >= len) {
+			hash -= qm_base_vals[(unsigned char) contig[i-len]] * base_pow;
+		}
+		hash = hash * HASH_BASE + val;
+		valid_bases++;
+
+		if (valid_bases >= len) {
+			hashes[i-len+1] = hash;
+			is_valid[i-len+1] = 1;
+		}
+	}
+}
+
+// Count mismatches between contig and read, stopping once max is exceeded
+static inline int count_mismatches(const char* contig, const char* read, int len, int max) {
+	int mismatches = 0;
+	for (int i=0; i<len && mismatches <= max; i++) {
+		mismatches += contig[i] != read[i];
+	}
+
+	return mismatches;
+}
+
+//
+// Find reads within max_mismatches of the contig using the seed index.  Each read is
+// only accepted via its first exactly matching segment, so hits are not duplicated.
+// Returns false if rejected by gate.
+char seed_map_contig(quick_map_ctx* ctx, const char* contig, int num_positions, coverage_gate* gate) {
+	int contig_len = strlen(contig);
+	int last_hit_pos = 0;
+
+	// Segments of equal length share rolling hashes
+	int hash_src[MAX_SEGMENTS];
+	for (int s=0; s<num_segments; s++) {
+		if (s > 0 && segments[s].len == segments[s-1].len) {
+			hash_src[s] = hash_src[s-1];
+		} else {
+			hash_src[s] = s;
+			rolling_hashes(contig, contig_len, segments[s].len, segments[s].base_pow, ctx->seg_hashes[s], ctx->seg_valid[s]);
+		}
+	}
+
+	for (int i=0; i<num_positions; i++) {
+		for (int s=0; s<num_segments; s++) {
+			seed_segment& segment = segments[s];
+			int seg_pos = i + segment.offset;
+
+			if (!ctx->seg_valid[hash_src[s]][seg_pos]) {
+				continue;
+			}
+
+			dense_hash_map<uint64_t, pair<int,int> >::const_iterator range = segment.ranges.find(ctx->seg_hashes[hash_src[s]][seg_pos]);
+			if (range == segment.ranges.end()) {
+				continue;
+			}
+
+			for (int e=range->second.first; e<range->second.second; e++) {
+				const char* read = segment.entries[e].reads->seq;
+
+				// Reject hash collisions and reads found via an earlier segment
+				if (memcmp(contig + seg_pos, read + segment.offset, segment.len) != 0) {
+					continue;
+				}
+
+				char is_dup = false;
+				for (int prev=0; prev<s && !is_dup; prev++) {
+					is_dup = memcmp(contig + i + segments[prev].offset, read + segments[prev].offset, segments[prev].len) == 0;
+				}
+
+				if (!is_dup) {
+					int mismatches = count_mismatches(contig + i, read, READ_LEN, max_mismatches);
+					if (mismatches <= max_mismatches) {
+						add_hits(ctx, segment.entries[e].reads, i+1, mismatches);
+						last_hit_pos = i+1;
+					}
 				}
 			}
 		}
+
+		if (!gate_passes(gate, last_hit_pos, i+1)) {
+			return 0;
+		}
+	}
+
+	return gate_passes_tail(gate, last_hit_pos, num_positions);
+}
+
+//
+// Map read pairs to contig.  If gate is non-NULL, mapping stops as soon as a gated
+// position is found to be uncovered, in which case false is returned and mapped_reads
+// and start_positions are left empty.
+char quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>& mapped_reads,
+		vector<pair<int, int> >& start_positions, coverage_gate* gate) {
+
+	quick_map_ctx* ctx = get_quick_map_ctx();
+	vector<map_info>& read1 = ctx->read1;
+	vector<map_info>& read2 = ctx->read2;
+	dense_hash_map<int, pair<int,int> >& mates = ctx->mates;
+
+	read1.clear();
+	read2.clear();
+	mates.clear_no_resize();
+
+	int num_positions = strlen(contig) - READ_LEN;
+
+	char is_mapped = num_segments > 0 ? seed_map_contig(ctx, contig, num_positions, gate) :
+			exact_map_contig(ctx, contig, num_positions, gate);
+
+	if (!is_mapped) {
+		return 0;
 	}
 
-	// Go through read 1 array looking for matches in read 2 map
-	for (int i=0; i<read1_count; i++) {
+	// Go through read 1 hits looking for read 2 hits of the same pair
+	for (int i=0; i<read1.size(); i++) {
 
-		map_info* r1 = read1[i];
-		map_info* r2 = read2[r1->info->id];
+		map_info* r1 = &read1[i];
 
-		if (r2 != NULL) {
+		dense_hash_map<int, pair<int,int> >::const_iterator mate = mates.find(r1->info->pair_id);
+		if (mate == mates.end()) {
+			continue;
+		}
+
+		for (int j = mate->second.first; j != -1; j = read2[j].next_mate) {
+
+			map_info* r2 = &read2[j];
 
 			if (r1->info->is_rc != r2->info->is_rc) {
 				short insert = abs(r1->pos - r2->pos) + READ_LEN;
@@ -236,12 +697,11 @@ void quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>
 					read_pair.pos1 = r1->pos;
 					read_pair.pos2 = r2->pos;
 					read_pair.insert = insert;
+					read_pair.mismatches1 = r1->mismatches;
+					read_pair.mismatches2 = r2->mismatches;
 					mapped_reads.push_back(read_pair);
 					start_positions.push_back(make_pair((int) read_pair.pos1, (int) read_pair.pos2));
 					start_positions.push_back(make_pair((int) read_pair.pos2, (int) read_pair.pos1));
-					if (should_output) {
-						output_mapping(contig_id, r1, r2, insert);
-					}
 				}
 			}
 		}
@@ -250,93 +710,357 @@ void quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>
 	// Now sort the start positions
 	sort(start_positions.begin(), start_positions.end());
 
-	// Clean up memory
-	for (int i=0; i<read1_count; i++) {
-		free(read1[i]);
+	return 1;
+}
+
+void output_header(vector<sam_contig>& contigs) {
+	string header = "@HD\tVN:1.4\tSO:unsorted\n";
+	char line[SAM_LINE_LEN];
+
+	for (int i=0; i<contigs.size(); i++) {
+		snprintf(line, SAM_LINE_LEN, "@SQ\tSN:%s\tLN:%ld\n", contigs[i].id, strlen(contigs[i].seq));
+		header.append(line);
 	}
 
-	free(read1);
+	fwrite(header.data(), 1, header.size(), stdout);
+}
+
+//
+// Mappings retained from window validation are formatted by a pool of threads, each
+// claiming the next contig and formatting its records into a per contig buffer.  A writer
+// thread drains buffers in contig order, so output is identical for any thread count.
+// Formatters stay at most MAX_PENDING_CONTIGS ahead of the writer to bound buffered output.
+//
+#define MAX_PENDING_CONTIGS 1024
+
+// Buffered output is flushed once it reaches this size
+#define SAM_WRITE_SIZE (4*1024*1024)
+
+struct sam_output {
+	vector<sam_contig>* contigs;
+	vector<string*> buffers;  // NULL until formatted
+	int next_contig;
+	int next_write;
+	pthread_mutex_t mutex;
+	pthread_cond_t mapped;
+	pthread_cond_t written;
+};
 
-	for (sparse_hash_map<const char*, struct map_info*, vjf_hash, vjf_eqstr>::const_iterator it = read2.begin();
-			it != read2.end(); ++it) {
+void* sam_format_thread(void* arg) {
+	sam_output* output = (sam_output*) arg;
+	vector<sam_contig>& contigs = *output->contigs;
 
-		map_info* m_info = it->second;
-		free(m_info);
+	int idx;
+	while ((idx = __sync_fetch_and_add(&output->next_contig, 1)) < contigs.size()) {
+
+		pthread_mutex_lock(&output->mutex);
+		while (idx >= output->next_write + MAX_PENDING_CONTIGS) {
+			pthread_cond_wait(&output->written, &output->mutex);
+		}
+		pthread_mutex_unlock(&output->mutex);
+
+		string* sam = new string();
+		for (int i=0; i<contigs[idx].num_mappings; i++) {
+			output_mapping(*sam, contigs[idx].id, contigs[idx].mappings[i]);
+		}
+
+		pthread_mutex_lock(&output->mutex);
+		output->buffers[idx] = sam;
+		if (idx == output->next_write) {
+			pthread_cond_signal(&output->mapped);
+		}
+		pthread_mutex_unlock(&output->mutex);
 	}
+
+	return NULL;
 }
 
-void quick_map_process_contig(char* contig_id, char* contig, vector<mapped_pair>& mapped_reads,
-		vector<pair<int, int> >& start_positions) {
+void* sam_write_thread(void* arg) {
+	sam_output* output = (sam_output*) arg;
+	int num_contigs = output->contigs->size();
+	string out;
+	out.reserve(SAM_WRITE_SIZE);
+
+	for (int idx=0; idx<num_contigs; idx++) {
+		pthread_mutex_lock(&output->mutex);
+		while (output->buffers[idx] == NULL) {
+			// Flush rather than hold buffered output while waiting on formatters
+			if (!out.empty()) {
+				pthread_mutex_unlock(&output->mutex);
+				fwrite(out.data(), 1, out.size(), stdout);
+				out.clear();
+				pthread_mutex_lock(&output->mutex);
+				continue;
+			}
+			pthread_cond_wait(&output->mapped, &output->mutex);
+		}
+		string* sam = output->buffers[idx];
+		output->buffers[idx] = NULL;
+		output->next_write = idx+1;
+		pthread_cond_broadcast(&output->written);
+		pthread_mutex_unlock(&output->mutex);
+
+		out.append(*sam);
+		delete sam;
+
+		if (out.size() >= SAM_WRITE_SIZE) {
+			fwrite(out.data(), 1, out.size(), stdout);
+			out.clear();
+		}
+
+		if (((idx+1) % 1000) == 0) {
+			fprintf(stderr, "[%d] contigs processed\n", idx+1);
+			fflush(stderr);
+		}
+	}
 
-	quick_map_process_contig(contig_id, contig, mapped_reads, start_positions, 0);
+	fwrite(out.data(), 1, out.size(), stdout);
+	fflush(stdout);
+
+	return NULL;
 }
 
-void output_header(char* contig_file) {
-	fprintf(stderr, "Writing header\n");
-	FILE* fp = fopen(contig_file, "r");
-	char contig_id[256];
-	char* contig = (char*) calloc(MAX_CONTIG_LEN, sizeof(char));
+void quick_map_output_contigs(vector<sam_contig>& contigs, int num_threads) {
+	output_header(contigs);
+
+	sam_output output;
+	output.contigs = &contigs;
+	output.buffers.resize(contigs.size(), NULL);
+	output.next_contig = 0;
+	output.next_write = 0;
+	pthread_mutex_init(&output.mutex, NULL);
+	pthread_cond_init(&output.mapped, NULL);
+	pthread_cond_init(&output.written, NULL);
 
-	printf("@HD\tVN:1.4\tSO:unsorted\n");
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+
+	pthread_t writer;
+	vector<pthread_t> formatters(num_threads);
+
+	int ret = pthread_create(&writer, NULL, sam_write_thread, &output);
+	if (ret != 0) {
+		fprintf(stderr, "Error creating writer thread: %d\n", ret);
+		exit(-1);
+	}
 
-	while (fgets(contig, MAX_CONTIG_LEN, fp) != NULL) {
-		contig[strlen(contig)-1] = '\0';  // strip newline
+	for (int i=0; i<num_threads; i++) {
+		ret = pthread_create(&formatters[i], NULL, sam_format_thread, &output);
+		if (ret != 0) {
+			fprintf(stderr, "Error creating formatting thread: %d\n", ret);
+			exit(-1);
+		}
+	}
+
+	for (int i=0; i<num_threads; i++) {
+		pthread_join(formatters[i], NULL);
+	}
+	pthread_join(writer, NULL);
 
-		if (contig[0] == '>') {
-			strncpy(contig_id, &(contig[1]), 256);
+	pthread_mutex_destroy(&output.mutex);
+	pthread_cond_destroy(&output.mapped);
+	pthread_cond_destroy(&output.written);
+}
+
+//
+// BAM output.  Pairs across all contigs are sorted by read name so that both
+// reads and all alignments of a pair are adjacent, as expected by RSEM.
+// Records are built directly from the mapped pairs and compressed on num_threads
+// BGZF threads.
+//
+struct bam_pair {
+	pair_mapping mapping;
+	int tid;
+};
+
+static inline const char* bam_read_id(read_info* info) {
+	return info->id[0] == '@' ? &(info->id[1]) : info->id;
+}
+
+// Natural read name order as used by samtools sort -n (strnum_cmp in bam_sort.c).
+// Digit runs are compared numerically, so SO:queryname holds for samtools tools.
+int read_name_cmp(const char* name1, const char* name2) {
+	const unsigned char* a = (const unsigned char*) name1;
+	const unsigned char* b = (const unsigned char*) name2;
+	const unsigned char* pa = a;
+	const unsigned char* pb = b;
+
+	while (*pa && *pb) {
+		if (isdigit(*pa) && isdigit(*pb)) {
+			while (*pa == '0') pa++;
+			while (*pb == '0') pb++;
+			while (isdigit(*pa) && isdigit(*pb) && *pa == *pb) {
+				pa++;
+				pb++;
+			}
+			if (isdigit(*pa) && isdigit(*pb)) {
+				// Longer digit run is the larger number, otherwise first differing digit
+				int i = 0;
+				while (isdigit(pa[i]) && isdigit(pb[i])) i++;
+				return isdigit(pa[i]) ? 1 : isdigit(pb[i]) ? -1 : (int) *pa - (int) *pb;
+			} else if (isdigit(*pa)) {
+				return 1;
+			} else if (isdigit(*pb)) {
+				return -1;
+			} else if (pa - a != pb - b) {
+				// Equal values, more leading zeros first
+				return pa - a < pb - b ? 1 : -1;
+			}
 		} else {
-			printf("@SQ\tSN:%s\tLN:%d\n", contig_id, strlen(contig));
+			if (*pa != *pb) {
+				return (int) *pa - (int) *pb;
+			}
+			pa++;
+			pb++;
 		}
 	}
 
-	//TODO: Add @PG
-	/*
-	char pg[10000];
-	pg[0] = '\0';
-	int chars_left = 9999;
-	for (int i=0; i<argc; i++) {
-		strncat(pg, argv[i], chars_left);
-		strcat(pg, " ");
-		chars_left = 10000 - strlen(pg);
+	return *pa ? 1 : *pb ? -1 : 0;
+}
+
+bool compare_bam_pairs(const bam_pair& p1, const bam_pair& p2) {
+	int cmp = read_name_cmp(bam_read_id(p1.mapping.r1), bam_read_id(p2.mapping.r1));
+	if (cmp != 0) {
+		return cmp < 0;
+	}
+	if (p1.tid != p2.tid) {
+		return p1.tid < p2.tid;
+	}
+	if (p1.mapping.pos1 != p2.mapping.pos1) {
+		return p1.mapping.pos1 < p2.mapping.pos1;
+	}
+	return p1.mapping.pos2 < p2.mapping.pos2;
+}
+
+// Populate b with a READ_LEN M alignment of read at pos.  Positions are 1 based.
+void set_bam_record(bam1_t* b, read_info* read, int flag, int tid, int pos, int mate_pos, int insert, int mismatches) {
+	const char* read_id = bam_read_id(read);
+	int l_qname = strlen(read_id) + 1;
+	int l_data = l_qname + 4 + (READ_LEN+1)/2 + READ_LEN;
+
+	if (b->m_data < l_data) {
+		b->m_data = l_data;
+		kroundup32(b->m_data);
+		b->data = (uint8_t*) realloc(b->data, b->m_data);
+	}
+	b->l_data = l_data;
+
+	bam1_core_t* c = &b->core;
+	c->tid = tid;
+	c->pos = pos-1;
+	c->bin = hts_reg2bin(c->pos, c->pos + READ_LEN, 14, 5);
+	c->qual = 255;
+	c->l_qname = l_qname;
+	c->flag = flag;
+	c->n_cigar = 1;
+	c->l_qseq = READ_LEN;
+	c->mtid = tid;
+	c->mpos = mate_pos-1;
+	c->isize = insert;
+
+	memcpy(bam_get_qname(b), read_id, l_qname);
+
+	uint32_t cigar = READ_LEN << BAM_CIGAR_SHIFT | BAM_CMATCH;
+	memcpy(bam_get_cigar(b), &cigar, 4);
+
+	uint8_t* seq = bam_get_seq(b);
+	memset(seq, 0, (READ_LEN+1)/2);
+	for (int i=0; i<READ_LEN; i++) {
+		seq[i>>1] |= seq_nt16_table[(unsigned char) read->seq[i]] << ((~i & 1) << 2);
 	}
 
-	printf("@PG\tID:quickmap\tPN:quickmap\tCL:%s\n", pg);
-	*/
+	uint8_t* qual = bam_get_qual(b);
+	for (int i=0; i<READ_LEN; i++) {
+		qual[i] = read->quals[i] - 33;
+	}
 
-	fclose(fp);
-	fprintf(stderr, "Done writing header\n");
-	fflush(stderr);
+	// Edit distance is only reported when mismatches are allowed
+	if (max_mismatches > 0) {
+		int32_t nm = mismatches;
+		bam_aux_append(b, "NM", 'i', 4, (uint8_t*) &nm);
+	}
 }
 
-void quick_map_process_contig_file(char* contig_file) {
-	output_header(contig_file);
+bam_hdr_t* build_bam_header(vector<sam_contig>& contigs, char* command_line) {
+	string text = "@HD\tVN:1.4\tSO:queryname\n";
+	char line[SAM_LINE_LEN];
+
+	for (int i=0; i<contigs.size(); i++) {
+		snprintf(line, SAM_LINE_LEN, "@SQ\tSN:%s\tLN:%ld\n", contigs[i].id, strlen(contigs[i].seq));
+		text.append(line);
+	}
 
-	FILE* fp = fopen(contig_file, "r");
-	char contig_id[256];
-	char* contig = (char*) calloc(MAX_CONTIG_LEN, sizeof(char));
-	int num_contigs = 0;
+	text.append("@PG\tID:vdjer\tPN:vdjer");
+	if (command_line != NULL) {
+		text.append("\tCL:");
+		text.append(command_line);
+	}
+	text.append("\n");
 
-	while (fgets(contig, MAX_CONTIG_LEN, fp) != NULL) {
-		contig[strlen(contig)-1] = '\0';
+	bam_hdr_t* header = sam_hdr_parse(text.size(), text.c_str());
+	header->l_text = text.size();
+	header->text = strdup(text.c_str());
 
-		if (contig[0] == '>') {
-			strncpy(contig_id, &(contig[1]), 256);
-		} else {
-//			fprintf(stderr, "Processing contig [%s]\n", contig_id);
-//			fflush(stderr);
-
-			vector<mapped_pair> mapped_reads;
-			vector<pair<int,int> > start_positions;
-			quick_map_process_contig(contig_id, contig, mapped_reads, start_positions, 1);
-			num_contigs++;
-			if ((num_contigs % 1000) == 0) {
-				fprintf(stderr, "[%d] contigs processed\n", num_contigs);
-				fflush(stderr);
-				fflush(stdout);
-			}
+	return header;
+}
+
+void quick_map_output_bam(vector<sam_contig>& contigs, int num_threads, char* bam_file, char* command_line) {
+
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
+
+	samFile* out = sam_open(bam_file, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "Unable to open BAM output file: %s\n", bam_file);
+		exit(-1);
+	}
+
+	if (num_threads > 1) {
+		hts_set_threads(out, num_threads);
+	}
+
+	bam_hdr_t* header = build_bam_header(contigs, command_line);
+	if (sam_hdr_write(out, header) < 0) {
+		fprintf(stderr, "Error writing BAM header to: %s\n", bam_file);
+		exit(-1);
+	}
+
+	vector<bam_pair> pairs;
+	for (int tid=0; tid<contigs.size(); tid++) {
+		for (int i=0; i<contigs[tid].num_mappings; i++) {
+			bam_pair bp;
+			bp.mapping = contigs[tid].mappings[i];
+			bp.tid = tid;
+			pairs.push_back(bp);
 		}
 	}
-	fclose(fp);
+
+	fprintf(stderr, "Sorting %ld mapped pairs by read name\n", pairs.size());
+	sort(pairs.begin(), pairs.end(), compare_bam_pairs);
+
+	bam1_t* b = bam_init1();
+	for (int i=0; i<pairs.size(); i++) {
+		pair_mapping& mp = pairs[i].mapping;
+		int tid = pairs[i].tid;
+
+		int flag1 = 0x1 | 0x2 | (mp.r1->is_rc ? 0x10 : 0x20) | 0x40;
+		int flag2 = 0x1 | 0x2 | (mp.r2->is_rc ? 0x10 : 0x20) | 0x80;
+
+		set_bam_record(b, mp.r1, flag1, tid, mp.pos1, mp.pos2, mp.insert, mp.mismatches1);
+		int ret = sam_write1(out, header, b);
+
+		set_bam_record(b, mp.r2, flag2, tid, mp.pos2, mp.pos1, mp.insert, mp.mismatches2);
+		if (ret < 0 || sam_write1(out, header, b) < 0) {
+			fprintf(stderr, "Error writing BAM record to: %s\n", bam_file);
+			exit(-1);
+		}
+	}
+
+	bam_destroy1(b);
+	bam_hdr_destroy(header);
+	sam_close(out);
 }
 
 /*
@@ -7,6 +7,7 @@ struct read_info {
 	char* id;
 	char* seq;
 	char* quals;
+	int pair_id;   // shared by both reads of a pair
 	char read_num;
 	char is_rc;
 };
@@ -14,6 +15,8 @@ struct read_info {
 struct map_info {
 	read_info* info;
 	short pos;
+	char mismatches;
+	int next_mate;  // index of the next read 2 hit with the same pair id, -1 if none
 };
 
 struct read_vec {
@@ -28,7 +31,36 @@ struct mapped_pair {
 	short pos1;    // read 1 position within contig
 	short pos2;    // read 2 position within contig
 	short insert;  // insert length
+	char mismatches1;
+	char mismatches2;
 };
 
+// Coverage requirement checked while mapping.  Every position in [cover_start, cover_end)
+// (1 based) must be covered by a read hit, otherwise mapping stops at the first uncovered
+// position, recorded in reject_pos.
+struct coverage_gate {
+	int cover_start;
+	int cover_end;
+	int reject_pos;
+};
+
+// Compact mapped pair retained with each validated window.  Positions are 1 based.
+struct pair_mapping {
+	read_info* r1;
+	read_info* r2;
+	short pos1;
+	short pos2;
+	short insert;
+	char mismatches1;
+	char mismatches2;
+};
+
+// Final contig and its mapped pairs passed to quick_map_output_contigs / quick_map_output_bam
+struct sam_contig {
+	char* id;
+	char* seq;
+	const pair_mapping* mappings;
+	int num_mappings;
+};
 
 #endif // __QUICK_MAP3__
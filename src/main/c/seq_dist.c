@@ -1,13 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
 #include <vector>
+#include <algorithm>
 #include "seq_dist.h"
+#include "anchor_index.h"
 
 using namespace std;
 
+//
+// Builds the V / J anchor index files (v_index / j_index) consumed by vj_filter.c.
+// For each germline anchor, all 16-mers within MAX_DIST mismatches are enumerated
+// directly and the min distance per 16-mer is recorded in a nibble per 16-mer table.
+// Output is "<2 bit encoded 16-mer>\t<min dist>" sorted by 16-mer.
+//
+// In --compile mode, text V and J index files are combined into the binary
+// format read by anchor_index.c.
+//
+
 #define MAX_16_BASES 4294967295
 #define MAX_DIST 5
 
+// Nibble table covering all 4^16 16-mers.  0 = not within MAX_DIST, otherwise dist+1.
+#define NIBBLES_PER_WORD 16
+#define NUM_NIBBLE_WORDS ((MAX_16_BASES+1) / NIBBLES_PER_WORD)
+
 int edit_dist(unsigned long i1, unsigned long i2) {
 	int dist;
 	unsigned long val;
@@ -34,63 +53,233 @@ int edit_distance(char* seq1, char* seq2) {
 	return dist;
 }
 
+// Returns 1 if line starts with SEQ_LEN unambiguous bases
+char is_valid_kmer(const char* kmer) {
+	for (int i=0; i<SEQ_LEN; i++) {
+		char base = kmer[i];
+		if (base != 'A' && base != 'C' && base != 'G' && base != 'T') {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
 void get_kmers(char* input, vector<unsigned long>& kmers) {
 	FILE* in = fopen(input, "r");
 
+	if (in == NULL) {
+		fprintf(stderr, "Unable to open anchor file: %s\n", input);
+		exit(-1);
+	}
+
 	char kmer[1024];
 	while (fgets(kmer, 1024, in) != NULL) {
-		unsigned long k = seq_to_int(kmer);
-		kmers.push_back(k);
+		if (is_valid_kmer(kmer)) {
+			unsigned long k = seq_to_int(kmer);
+			kmers.push_back(k);
+		} else {
+			fprintf(stderr, "Skipping anchor: %s", kmer);
+		}
 	}
 
 	fclose(in);
 }
 
-void process_kmers(char* input, unsigned long start, unsigned long end) {
+struct neighbourhood_job {
+	vector<unsigned long>* kmers;
+	uint64_t* nibbles;
+	int max_dist;
+	int next_kmer;
+};
+
+// Lower the recorded distance for code to dist if smaller
+void record_dist(uint64_t* nibbles, uint32_t code, int dist) {
+	uint64_t* word = &nibbles[code / NIBBLES_PER_WORD];
+	int shift = (code % NIBBLES_PER_WORD) * 4;
+	uint64_t val = dist + 1;
+
+	uint64_t old_word = *word;
+	while (1) {
+		uint64_t old_val = (old_word >> shift) & 0xF;
+		if (old_val != 0 && old_val <= val) {
+			break;
+		}
+
+		uint64_t new_word = (old_word & ~(0xFULL << shift)) | (val << shift);
+		uint64_t prev = __sync_val_compare_and_swap(word, old_word, new_word);
+		if (prev == old_word) {
+			break;
+		}
+		old_word = prev;
+	}
+}
+
+//
+// Visit every code within max_dist of anchor.  Substitutions are applied at increasing
+// positions so each code is visited once with its exact distance from the anchor.
+void enumerate_neighbourhood(uint64_t* nibbles, uint32_t anchor, uint32_t code, int start_pos, int dist, int max_dist) {
+	record_dist(nibbles, code, dist);
+
+	if (dist < max_dist) {
+		for (int pos=start_pos; pos<SEQ_LEN; pos++) {
+			int shift = pos*2;
+			uint32_t orig = (anchor >> shift) & 3;
+			for (uint32_t alt=0; alt<4; alt++) {
+				if (alt != orig) {
+					enumerate_neighbourhood(nibbles, anchor, code ^ ((orig ^ alt) << shift), pos+1, dist+1, max_dist);
+				}
+			}
+		}
+	}
+}
+
+void* neighbourhood_thread(void* arg) {
+	neighbourhood_job* job = (neighbourhood_job*) arg;
+
+	int idx;
+	while ((idx = __sync_fetch_and_add(&job->next_kmer, 1)) < job->kmers->size()) {
+		uint32_t anchor = (*job->kmers)[idx];
+		enumerate_neighbourhood(job->nibbles, anchor, anchor, 0, 0, job->max_dist);
+	}
+
+	return NULL;
+}
+
+void process_kmers(char* input, int max_dist, int num_threads) {
 
 	vector<unsigned long> kmers;
 	get_kmers(input, kmers);
 
-	// for (unsigned long i=0; i<MAX_16_BASES; i++) {
-	for (unsigned long i=start; i<=end; i++) {
+	fprintf(stderr, "Enumerating %d mismatch neighbourhoods of %ld anchors\n", max_dist, kmers.size());
+
+	uint64_t* nibbles = (uint64_t*) calloc(NUM_NIBBLE_WORDS, sizeof(uint64_t));
+	if (nibbles == NULL) {
+		fprintf(stderr, "Unable to allocate 16-mer table\n");
+		exit(-1);
+	}
+
+	neighbourhood_job job;
+	job.kmers = &kmers;
+	job.nibbles = nibbles;
+	job.max_dist = max_dist;
+	job.next_kmer = 0;
 
-		int min_dist = SEQ_LEN + 1;
+	vector<pthread_t> threads(num_threads);
+	for (int i=0; i<num_threads; i++) {
+		int ret = pthread_create(&threads[i], NULL, neighbourhood_thread, &job);
+		if (ret != 0) {
+			fprintf(stderr, "Error creating thread: %d\n", ret);
+			exit(-1);
+		}
+	}
 
-		vector<unsigned long>::const_iterator kmer;
-		for (kmer=kmers.begin(); kmer!=kmers.end(); kmer++) {
-			int dist = edit_dist(i, *kmer);
-			if (dist < min_dist) {
-				min_dist = dist;
+	for (int i=0; i<num_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	// Table order is code order, so output is sorted
+	long count = 0;
+	for (unsigned long w=0; w<NUM_NIBBLE_WORDS; w++) {
+		uint64_t word = nibbles[w];
+		if (word != 0) {
+			for (int n=0; n<NIBBLES_PER_WORD; n++) {
+				int val = (word >> (n*4)) & 0xF;
+				if (val != 0) {
+					printf("%lu\t%d\n", w * NIBBLES_PER_WORD + n, val-1);
+					count++;
+				}
 			}
 		}
+	}
+
+	fprintf(stderr, "Wrote %ld kmers\n", count);
+
+	free(nibbles);
+}
+
+// Read text index entries.  is_j selects the dist nibble to populate.
+void load_index_entries(char* input, char is_j, vector<anchor_entry>& entries) {
+	FILE* in = fopen(input, "r");
+
+	if (in == NULL) {
+		fprintf(stderr, "Unable to open index file: %s\n", input);
+		exit(-1);
+	}
+
+	unsigned long kmer;
+	int dist;
+	while (fscanf(in, "%lu\t%d\n", &kmer, &dist) == 2) {
+		if (dist < 0 || dist >= ANCHOR_INDEX_NO_DIST) {
+			fprintf(stderr, "Invalid dist in %s: %lu\t%d\n", input, kmer, dist);
+			exit(-1);
+		}
+
+		anchor_entry entry;
+		entry.code = kmer;
+		entry.dists = is_j ? (dist << 4) | ANCHOR_INDEX_NO_DIST : (ANCHOR_INDEX_NO_DIST << 4) | dist;
+		entries.push_back(entry);
+	}
 
-		if (min_dist <= MAX_DIST) {
-			printf("%lu\t%d\n", i, min_dist);
+	fclose(in);
+}
+
+bool compare_codes(const anchor_entry& e1, const anchor_entry& e2) {
+	return e1.code < e2.code;
+}
+
+void compile_index(char* v_index, char* j_index, char* output) {
+	vector<anchor_entry> entries;
+	load_index_entries(v_index, 0, entries);
+	load_index_entries(j_index, 1, entries);
+
+	sort(entries.begin(), entries.end(), compare_codes);
+
+	// Merge V and J entries for the same kmer keeping the min dist per nibble
+	size_t num_merged = 0;
+	for (size_t i=0; i<entries.size(); i++) {
+		if (num_merged > 0 && entries[num_merged-1].code == entries[i].code) {
+			uint8_t d1 = entries[num_merged-1].dists;
+			uint8_t d2 = entries[i].dists;
+			uint8_t v = (d1 & 0xF) < (d2 & 0xF) ? (d1 & 0xF) : (d2 & 0xF);
+			uint8_t j = (d1 >> 4) < (d2 >> 4) ? (d1 >> 4) : (d2 >> 4);
+			entries[num_merged-1].dists = (j << 4) | v;
+		} else {
+			entries[num_merged++] = entries[i];
 		}
 	}
+	entries.resize(num_merged);
+
+	anchor_index_write(output, entries);
+
+	fprintf(stderr, "Wrote %ld kmers to %s\n", entries.size(), output);
 }
 
-/*
 int main(int argc, char** argv) {
 
-	if (argc != 4) {
-		fprintf(stderr, "Usage: seqd <input> <start> <end>\n");
+	if (argc == 5 && strcmp(argv[1], "--compile") == 0) {
+		compile_index(argv[2], argv[3], argv[4]);
+		return 0;
+	}
+
+	if (argc < 3 || argc > 4) {
+		fprintf(stderr, "Usage: seqd <anchor_file> <max_dist> [threads]\n");
+		fprintf(stderr, "       seqd --compile <v_index> <j_index> <vj_index.bin>\n");
 		exit(-1);
 	}
 
 	char* input = argv[1];
-	unsigned long start = strtoul(argv[2], NULL, 10);
-	unsigned long end   = strtoul(argv[3], NULL, 10);
-
-	process_kmers(input, start, end);
+	int max_dist = atoi(argv[2]);
+	int num_threads = argc == 4 ? atoi(argv[3]) : 1;
 
-	char* s1 = "GATTCCGGCGCCGATC";
-//	char* s2 = "GATACCGGCGCCGATG";
-	char* s2 = "AGAAAAAAAAAAACAA";
-	int dist = edit_distance(s1, s2);
-
-	printf("dist: %d\n", dist);
+	if (max_dist < 0 || max_dist > MAX_DIST) {
+		fprintf(stderr, "max_dist must be between 0 and %d\n", MAX_DIST);
+		exit(-1);
+	}
 
+	if (num_threads < 1) {
+		num_threads = 1;
+	}
 
+	process_kmers(input, max_dist, num_threads);
 }
-*/
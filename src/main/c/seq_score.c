@@ -2,8 +2,9 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <set>
+#include <pthread.h>
 #include <vector>
+#include <algorithm>
 #include <sparsehash/dense_hash_map>
 #include "seq_score.h"
 #include "hash_utils.h"
@@ -11,15 +12,55 @@
 using namespace std;
 using google::dense_hash_map;
 
-char* seq_score_matrix;
-int seq_score_size;
+int seq_score_max_len1;
 char** ref_contigs;
 vector<char*> seq_score_contigs;
 
 #define CONTIG_BUF_MAX 10000000
 vector<char*> score_seq_contigs;
 
-dense_hash_map<const char*, vector<int>, vregion_hash, vregion_eqstr> contig_index;
+//
+// V region seed index.  2 bit codes of all VREGION_KMER_SIZE seeds sorted by code, with
+// the parallel array holding (contig << 32 | position) for each seed.
+vector<uint32_t> seed_codes;
+vector<uint64_t> seed_locs;
+
+// Only the diagonals with the most seed hits in each contig are extended
+#define MAX_DIAGONALS_PER_CONTIG 3
+
+// Per thread seed hit buffer (contig << 32 | diagonal + offset), reused across calls.
+__thread vector<uint64_t>* seed_hits = NULL;
+
+// Score results by 2 bit packed kmer (up to 64 bases)
+struct packed_kmer {
+	uint64_t hi;
+	uint64_t lo;
+	int threshold;
+};
+
+struct packed_kmer_hash
+{
+	size_t operator()(const packed_kmer& kmer) const
+	{
+		return MurmurHash64A(&kmer, sizeof(uint64_t)*2, 97) ^ kmer.threshold;
+	}
+};
+
+struct packed_kmer_eq
+{
+	bool operator()(const packed_kmer& k1, const packed_kmer& k2) const
+	{
+		return k1.hi == k2.hi && k1.lo == k2.lo && k1.threshold == k2.threshold;
+	}
+};
+
+dense_hash_map<packed_kmer, char, packed_kmer_hash, packed_kmer_eq> score_cache;
+pthread_mutex_t score_cache_mutex;
+
+// Per thread DP columns, allocated on first use.
+__thread int* seq_score_prev_col = NULL;
+__thread int* seq_score_curr_col = NULL;
+__thread int seq_score_col_capacity = 0;
 
 //int kmer_size = 35;
 //int VREGION_KMER_SIZE = 11;
@@ -29,123 +70,246 @@ extern int VREGION_KMER_SIZE;
 
 
 void score_seq_init(int max_len1, int max_len2) {
-	seq_score_size = (max_len1+1) * (max_len2+1);
-	seq_score_matrix = (char*) calloc(seq_score_size, sizeof(int));
+	seq_score_max_len1 = max_len1;
+}
+
+static inline int seed_base_val(char base) {
+	switch (base) {
+		case 'A': return 0;
+		case 'C': return 1;
+		case 'G': return 2;
+		case 'T': return 3;
+		default: return -1;
+	}
 }
 
-void add_to_index(char* contig) {
-	int stop = strlen(contig)-VREGION_KMER_SIZE;
-	for (int i=0; i<stop; i++) {
-//		printf("i: %d\n", i);
-		if (contig_index.find(contig+i) == contig_index.end()) {
-			vector<int> positions;
-			positions.push_back(i);
-			contig_index[contig+i] = positions;
+//
+// Calls callback(pos, code) for each seed of seq free of ambiguous bases.
+// The code is rolled one base at a time and the window is restarted after an ambiguous base.
+template <typename F>
+void for_each_seed(const char* seq, int len, F callback) {
+	uint32_t mask = VREGION_KMER_SIZE >= 16 ? 0xFFFFFFFF : ((1U << (2*VREGION_KMER_SIZE)) - 1);
+	uint32_t code = 0;
+	int valid = 0;
+
+	for (int i=0; i<len; i++) {
+		int val = seed_base_val(seq[i]);
+		if (val < 0) {
+			valid = 0;
+			code = 0;
 		} else {
-			contig_index[contig+i].push_back(i);
+			code = ((code << 2) | val) & mask;
+			valid++;
+			if (valid >= VREGION_KMER_SIZE) {
+				callback(i-VREGION_KMER_SIZE+1, code);
+			}
 		}
 	}
 }
 
+struct seed_collector {
+	vector<pair<uint32_t, uint64_t> >* seeds;
+	uint64_t contig;
+	void operator()(int pos, uint32_t code) {
+		seeds->push_back(make_pair(code, (contig << 32) | pos));
+	}
+};
+
+void add_to_index(int contig_num, char* contig, vector<pair<uint32_t, uint64_t> >& seeds) {
+	seed_collector collector;
+	collector.seeds = &seeds;
+	collector.contig = contig_num;
+	for_each_seed(contig, strlen(contig), collector);
+}
+
 void score_seq_init(int max_len1, int max_len2, char* fasta) {
-	contig_index.set_empty_key(NULL);
+
+	// Packed kmers are offset by 1 so all zero is never a valid key
+	packed_kmer empty_key;
+	empty_key.hi = 0;
+	empty_key.lo = 0;
+	empty_key.threshold = 0;
+	score_cache.set_empty_key(empty_key);
+	pthread_mutex_init(&score_cache_mutex, NULL);
+
 	score_seq_init(max_len1, max_len2);
 
 	fflush(stdout);
 	char* contig = (char*) calloc(CONTIG_BUF_MAX, sizeof(char));
 	FILE* fp = fopen(fasta, "r");
+	vector<pair<uint32_t, uint64_t> > seeds;
 
 	while (fgets(contig, 1000000, fp) != NULL) {
 		if (contig[0] != '>') {
 			// Get rid of newline
 			contig[strlen(contig)-1] = '\0';
+			add_to_index(score_seq_contigs.size(), contig, seeds);
 			score_seq_contigs.push_back(contig);
-			add_to_index(contig);
 		}
 
 		contig = (char*) calloc(CONTIG_BUF_MAX, sizeof(char));
 	}
 	fflush(stdout);
 	fclose(fp);
-}
 
-int seq_score_index(int row, int col, int len1) {
-	return col*(len1+1) + row;
-}
-
-int score_entry(int row, int col, const char* seq1, const char* seq2, int len1, char* matrix) {
-	int val1 = matrix[seq_score_index(row,col-1,len1)] + GAP_PENALTY;
-	int val2 = matrix[seq_score_index(row-1,col,len1)] + GAP_PENALTY;
-	int val3 = matrix[seq_score_index(row-1,col-1,len1)] + (seq1[row-1] == seq2[col-1] ? MATCH_SCORE : MISMATCH_PENALTY);
-
-	int max = val1 > val2 ? val1 : val2;
-	max = max > val3 ? max : val3;
-
-	// Do not allow negative scores
-//	max = max < 0 ? 0 : max;
+	sort(seeds.begin(), seeds.end());
+	seed_codes.resize(seeds.size());
+	seed_locs.resize(seeds.size());
+	for (size_t i=0; i<seeds.size(); i++) {
+		seed_codes[i] = seeds[i].first;
+		seed_locs[i] = seeds[i].second;
+	}
 
-	return max;
+	fprintf(stderr, "V region seed index: %ld seeds in %ld contigs\n", seed_codes.size(), score_seq_contigs.size());
 }
 
 //
-// Identifies max local alignment score for seq1 within seq2
+// Identifies whether the max alignment score for seq1 within seq2 reaches threshold.
+// Only two DP columns are kept.  Returns as soon as a cell reaches threshold, or
+// once no remaining cell can (each remaining column adds at most 1 to any score).
 int score_seq(const char* seq1, const char* seq2, int len1, int len2, int threshold) {
-	memset(seq_score_matrix, 0, seq_score_size * sizeof(int));
 
-	char* matrix = seq_score_matrix;
+	// Boundary cells are 0
+	if (threshold <= 0) {
+		return 1;
+	}
+
+	// Columns are sized for the larger of len1 and the max length given to score_seq_init
+	if (seq_score_prev_col == NULL || len1 > seq_score_col_capacity) {
+		seq_score_col_capacity = max(len1, seq_score_max_len1);
+		free(seq_score_prev_col);
+		free(seq_score_curr_col);
+		seq_score_prev_col = (int*) calloc(seq_score_col_capacity+1, sizeof(int));
+		seq_score_curr_col = (int*) calloc(seq_score_col_capacity+1, sizeof(int));
+	}
+
+	int* prev = seq_score_prev_col;
+	int* curr = seq_score_curr_col;
+	memset(prev, 0, (len1+1) * sizeof(int));
+	curr[0] = 0;
+
 	for (int col=1; col<=len2; col++) {
+		char base = seq2[col-1];
+		int remaining_cols = len2 - col;
+
+		// Best achievable score given this column.  An alignment starting from the
+		// row 0 boundary in a later column can reach at most min(len1, remaining_cols).
+		int best_possible = remaining_cols < len1 ? remaining_cols : len1;
+
 		for (int row=1; row<=len1; row++) {
-			matrix[seq_score_index(row, col, len1)] = score_entry(row, col, seq1, seq2, len1, matrix);
-//			printf("%d,", matrix[seq_score_index(row, col, len1)]);
-		}
-//		printf("\n");
-	}
+			int val1 = prev[row] + GAP_PENALTY;
+			int val2 = curr[row-1] + GAP_PENALTY;
+			int val3 = prev[row-1] + (seq1[row-1] == base ? MATCH_SCORE : MISMATCH_PENALTY);
 
-	int max = -1;
-	int row = len1;
-	for (int col=0; col<=len2; col++) {
-		for (int row=0; row<=len1; row++) {
-			int val = matrix[seq_score_index(row, col, len1)];
-			if (val >= threshold) {
+			int max = val1 > val2 ? val1 : val2;
+			max = max > val3 ? max : val3;
+			curr[row] = max;
+
+			if (max >= threshold) {
 				return 1;
 			}
+
+			int remaining_rows = len1 - row;
+			int possible = max + (remaining_rows < remaining_cols ? remaining_rows : remaining_cols);
+			if (possible > best_possible) {
+				best_possible = possible;
+			}
+		}
+
+		if (best_possible < threshold) {
+			return 0;
 		}
+
+		int* temp = prev;
+		prev = curr;
+		curr = temp;
 	}
 
 	return 0;
 }
 
+struct seed_hit_collector {
+	vector<uint64_t>* hits;
+	int seq_len;
+	void operator()(int pos, uint32_t code) {
+		vector<uint32_t>::const_iterator it = lower_bound(seed_codes.begin(), seed_codes.end(), code);
+		for (size_t idx = it - seed_codes.begin(); idx < seed_codes.size() && seed_codes[idx] == code; idx++) {
+			uint64_t contig = seed_locs[idx] >> 32;
+			int contig_pos = (int) (seed_locs[idx] & 0xFFFFFFFF);
+			// Diagonal is the contig position aligned to the start of seq.  Offset to keep it non-negative.
+			uint32_t diagonal = contig_pos - pos + seq_len;
+			hits->push_back((contig << 32) | diagonal);
+		}
+	}
+};
+
+//
+// Seeds seq against the V region index, buckets hits by (contig, diagonal) and
+// aligns seq against a window around the best few diagonals of each contig.
 int score_seq(const char* seq1, int seq_len, int threshold) {
 
-	set<int> to_search;
-	int stop = seq_len - VREGION_KMER_SIZE;
+	if (seed_hits == NULL) {
+		seed_hits = new vector<uint64_t>();
+	}
+
+	vector<uint64_t>& hits = *seed_hits;
+	hits.clear();
+
+	seed_hit_collector collector;
+	collector.hits = &hits;
+	collector.seq_len = seq_len;
+	for_each_seed(seq1, seq_len, collector);
 
-	// Identify hits in hash index
-	for (int i=0; i<stop; i++) {
-		if (contig_index.find(seq1+i) != contig_index.end()) {
-			vector<int> positions = contig_index[seq1+i];
-			for (vector<int>::iterator it=positions.begin(); it!= positions.end(); ++it) {
-				to_search.insert(*it);
+	sort(hits.begin(), hits.end());
+
+	int window_len = kmer_size*2;
+	size_t i = 0;
+	while (i < hits.size()) {
+		uint64_t contig = hits[i] >> 32;
+
+		// Best diagonals for this contig by number of seed hits
+		int best_diags[MAX_DIAGONALS_PER_CONTIG];
+		int best_counts[MAX_DIAGONALS_PER_CONTIG];
+		int num_best = 0;
+
+		while (i < hits.size() && (hits[i] >> 32) == contig) {
+			uint64_t curr = hits[i];
+			int count = 0;
+			while (i < hits.size() && hits[i] == curr) {
+				count++;
+				i++;
+			}
+
+			int diagonal = (int) (curr & 0xFFFFFFFF) - seq_len;
+			int slot = num_best < MAX_DIAGONALS_PER_CONTIG ? num_best++ : MAX_DIAGONALS_PER_CONTIG;
+			while (slot > 0 && best_counts[slot-1] < count) {
+				if (slot < MAX_DIAGONALS_PER_CONTIG) {
+					best_counts[slot] = best_counts[slot-1];
+					best_diags[slot] = best_diags[slot-1];
+				}
+				slot--;
+			}
+			if (slot < MAX_DIAGONALS_PER_CONTIG) {
+				best_counts[slot] = count;
+				best_diags[slot] = diagonal;
 			}
 		}
-	}
 
-//	printf("to_search: %d\t", to_search.size());
+		const char* ref = score_seq_contigs[contig];
+		int ref_len = strlen(ref);
 
-	int max = -1;
-	for (vector<char*>::const_iterator it=score_seq_contigs.begin(); it != score_seq_contigs.end(); ++it) {
-		for (set<int>::iterator idx=to_search.begin(); idx != to_search.end(); ++idx) {
-			int start_idx = *idx - kmer_size;
+		for (int d=0; d<num_best; d++) {
+			// Window centered on the diagonal with slack for gaps on either side
+			int start_idx = best_diags[d] - (window_len - seq_len) / 2;
+			if (start_idx > ref_len - window_len) {
+				start_idx = ref_len - window_len;
+			}
 			if (start_idx < 0) {
 				start_idx = 0;
 			}
-			if (start_idx >= strlen(*it)-kmer_size*2) {
-				start_idx = strlen(*it)-kmer_size*2 - 1;
-			}
+			int len2 = ref_len - start_idx < window_len ? ref_len - start_idx : window_len;
 
-			int score = score_seq(seq1, *it + start_idx, seq_len, kmer_size*2, threshold);
-
-			if (score == 1) {
+			if (score_seq(seq1, ref + start_idx, seq_len, len2, threshold)) {
 				return 1;
 			}
 		}
@@ -159,6 +323,58 @@ int score_seq(const char* seq1, int threshold) {
 	return score_seq(seq1, kmer_size, threshold);
 }
 
+// Returns 0 if the seq cannot be packed
+char pack_kmer(const char* seq, int len, packed_kmer& kmer) {
+	if (len > 63) {
+		return 0;
+	}
+
+	kmer.hi = 0;
+	kmer.lo = 1;
+	for (int i=0; i<len; i++) {
+		uint64_t val;
+		switch (seq[i]) {
+			case 'A': val = 0; break;
+			case 'C': val = 1; break;
+			case 'G': val = 2; break;
+			case 'T': val = 3; break;
+			default: return 0;
+		}
+
+		kmer.hi = (kmer.hi << 2) | (kmer.lo >> 62);
+		kmer.lo = (kmer.lo << 2) | val;
+	}
+
+	return 1;
+}
+
+int score_seq_cached(const char* seq1, int threshold) {
+	packed_kmer kmer;
+	if (!pack_kmer(seq1, kmer_size, kmer)) {
+		return score_seq(seq1, threshold);
+	}
+	kmer.threshold = threshold;
+
+	int score = -1;
+	pthread_mutex_lock(&score_cache_mutex);
+	dense_hash_map<packed_kmer, char, packed_kmer_hash, packed_kmer_eq>::const_iterator it = score_cache.find(kmer);
+	if (it != score_cache.end()) {
+		score = it->second;
+	}
+	pthread_mutex_unlock(&score_cache_mutex);
+
+	if (score < 0) {
+		// Scored outside of the lock.  Concurrent misses on the same kmer compute the same result.
+		score = score_seq(seq1, threshold);
+
+		pthread_mutex_lock(&score_cache_mutex);
+		score_cache[kmer] = score;
+		pthread_mutex_unlock(&score_cache_mutex);
+	}
+
+	return score;
+}
+
 /*
 int main(int argc, char* argv[]) {
 
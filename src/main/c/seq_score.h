@@ -15,4 +15,7 @@ void score_seq_init(int max_len1, int max_len2, char* fasta);
 // Returns 1 if threshold is reached, 0 otherwise
 int score_seq(const char* seq, int threshold);
 
+// Same as score_seq, but results are cached by packed kmer.  Thread safe.
+int score_seq_cached(const char* seq, int threshold);
+
 #endif
@@ -0,0 +1,165 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+#include <time.h>
+#include <vector>
+
+using namespace std;
+
+//
+// Microbenchmark of the contig traversal step in assembler2_vdj.c build_contigs.
+// Compares scoring a step by summing successor frequencies and calling log10 per
+// step (as before edge scores were precomputed) against adding the fixed point
+// edge score stored on the adjacency by compute_edge_scores.
+//
+// A synthetic graph of random out degree and frequencies is walked along random
+// paths.  As in build_contigs, every successor of a node is scored when stepping
+// through it, one per branch.
+//
+// Usage: traversal_bench [num_nodes] [num_steps]
+//
+
+// Must match assembler2_vdj.c
+#define SCORE_SCALE 65536
+
+struct bench_node;
+
+struct bench_link {
+	bench_node* node;
+	bench_link* next;
+	int score;
+};
+
+struct bench_node {
+	int frequency;
+	bench_link* toNodes;
+};
+
+double elapsed_secs(struct timespec& start) {
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+// Mostly linear, with occasional branches as in a condensed de Bruijn graph
+int random_degree() {
+	int r = rand() % 100;
+	return r < 80 ? 1 : r < 95 ? 2 : r < 99 ? 3 : 4;
+}
+
+void build_graph(vector<bench_node>& nodes, vector<bench_link>& links) {
+	int num_nodes = nodes.size();
+
+	for (int i=0; i<num_nodes; i++) {
+		nodes[i].frequency = 1 + rand() % 1000;
+		nodes[i].toNodes = NULL;
+	}
+
+	links.reserve(num_nodes * 4);
+	for (int i=0; i<num_nodes; i++) {
+		int degree = random_degree();
+		for (int d=0; d<degree; d++) {
+			links.push_back(bench_link());
+			bench_link* link = &links.back();
+			link->node = &nodes[rand() % num_nodes];
+			link->next = nodes[i].toNodes;
+			nodes[i].toNodes = link;
+		}
+	}
+
+	// Same computation as compute_edge_scores
+	for (int i=0; i<num_nodes; i++) {
+		int total_edge_count = 0;
+		for (bench_link* to = nodes[i].toNodes; to != NULL; to = to->next) {
+			total_edge_count += to->node->frequency;
+		}
+
+		double log10_total_edge_count = log10(total_edge_count);
+		for (bench_link* to = nodes[i].toNodes; to != NULL; to = to->next) {
+			to->score = (int) lround((log10(to->node->frequency) - log10_total_edge_count) * SCORE_SCALE);
+		}
+	}
+}
+
+// Score steps the pre-change way.  Returns the sum of branch scores.
+double walk_log10(vector<bench_node>& nodes, vector<int>& choices) {
+	bench_node* curr = &nodes[0];
+	double score = 0;
+
+	for (size_t s=0; s<choices.size(); s++) {
+		int total_edge_count = 0;
+		for (bench_link* to = curr->toNodes; to != NULL; to = to->next) {
+			total_edge_count = total_edge_count + to->node->frequency;
+		}
+
+		double log10_total_edge_count = log10(total_edge_count);
+
+		bench_link* next = NULL;
+		int c = 0;
+		for (bench_link* to = curr->toNodes; to != NULL; to = to->next, c++) {
+			score = score + log10(to->node->frequency) - log10_total_edge_count;
+			if (c == choices[s] % 4 || next == NULL) {
+				next = to;
+			}
+		}
+
+		curr = next->node;
+	}
+
+	return score;
+}
+
+// Score steps using precomputed fixed point edge scores
+long walk_fixed(vector<bench_node>& nodes, vector<int>& choices) {
+	bench_node* curr = &nodes[0];
+	long score = 0;
+
+	for (size_t s=0; s<choices.size(); s++) {
+		bench_link* next = NULL;
+		int c = 0;
+		for (bench_link* to = curr->toNodes; to != NULL; to = to->next, c++) {
+			score = score + to->score;
+			if (c == choices[s] % 4 || next == NULL) {
+				next = to;
+			}
+		}
+
+		curr = next->node;
+	}
+
+	return score;
+}
+
+int main(int argc, char** argv) {
+	int num_nodes = argc > 1 ? atoi(argv[1]) : 1000000;
+	long num_steps = argc > 2 ? atol(argv[2]) : 50000000;
+
+	srand(42);
+
+	vector<bench_node> nodes(num_nodes);
+	vector<bench_link> links;
+	build_graph(nodes, links);
+
+	vector<int> choices(num_steps);
+	for (long i=0; i<num_steps; i++) {
+		choices[i] = rand();
+	}
+
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	double log10_score = walk_log10(nodes, choices);
+	double log10_secs = elapsed_secs(start);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	long fixed_score = walk_fixed(nodes, choices);
+	double fixed_secs = elapsed_secs(start);
+
+	printf("nodes: %d, steps: %ld\n", num_nodes, num_steps);
+	printf("log10 per step:\t%.3f secs\t%.1f ns/step\tscore: %.2f\n", log10_secs, log10_secs * 1e9 / num_steps, log10_score);
+	printf("fixed point:\t%.3f secs\t%.1f ns/step\tscore: %.2f\n", fixed_secs, fixed_secs * 1e9 / num_steps,
+			(double) fixed_score / SCORE_SCALE);
+	printf("speedup:\t%.2fx\n", log10_secs / fixed_secs);
+
+	return 0;
+}
@@ -4,12 +4,15 @@
 #include <stdlib.h>
 #include <string.h>
 #include <vector>
+#include <algorithm>
 #include <sparsehash/sparse_hash_map>
 #include <sparsehash/sparse_hash_set>
 #include <sparsehash/dense_hash_map>
 #include <sparsehash/dense_hash_set>
 #include "hash_utils.h"
 #include "vj_filter.h"
+#include "anchor_index.h"
+#include "arena.h"
 
 using namespace std;
 using google::sparse_hash_set;
@@ -35,7 +38,7 @@ uint64_t MurmurHash64A ( const void * key, int len, uint64_t seed );
 
 struct eqkmer
 {
-  bool operator()(unsigned long l1, unsigned long l2) const
+  bool operator()(uint64_t l1, uint64_t l2) const
   {
     return l1 == l2;
   }
@@ -43,89 +46,211 @@ struct eqkmer
 
 struct kmer_hash
 {
-	uint64_t operator()(unsigned long kmer) const
+	uint64_t operator()(uint64_t kmer) const
 	{
-		return MurmurHash64A(&kmer, 4, 97);
-		//return chunk;
+		return MurmurHash64A(&kmer, sizeof(uint64_t), 97);
 	}
 };
 
-dense_hash_set<unsigned long, kmer_hash, eqkmer>* vmers;
-dense_hash_set<unsigned long, kmer_hash, eqkmer>* jmers;
+// Combined V / J anchor table.  Keys are 2 bit encoded SEQ_LEN-mers, so all 64 bit ones is never a valid key.
+#define ANCHOR_EMPTY_KEY 0xFFFFFFFFFFFFFFFFULL
+dense_hash_map<uint64_t, char, kmer_hash, eqkmer>* anchors;
+
+// Memory mapped binary anchor index.  Used in place of the anchor table when available.
+anchor_index* anchor_idx = NULL;
+int anchor_max_dist;
+
+//
+// Pigeonhole anchor matcher.  Only germline (dist 0) anchors are indexed.  Each anchor is
+// split into max_dist+1 segments, so any kmer within max_dist mismatches of an anchor
+// matches it exactly in at least one segment.  Candidates sharing a segment are verified
+// by counting differing 2 bit bases.
+struct seed_matcher {
+	int num_segments;
+	int seg_offset[SEQ_LEN];   // bases from the low end of the code
+	int seg_len[SEQ_LEN];
+	vector<int> bucket_start[SEQ_LEN];
+	vector<int> bucket_anchors[SEQ_LEN];
+	vector<uint32_t> codes;
+	vector<char> flags;
+};
+
+seed_matcher* anchor_seeds = NULL;
+char use_seed_matcher = 0;
+
+// 2 bit base codes matching seq_to_int.  -1 for ambiguous bases.
+signed char anchor_base_vals[256];
 
-void load_kmers(char* input, dense_hash_set<unsigned long, kmer_hash, eqkmer>* kmers, int max_dist) {
+void load_kmers(char* input, char flag, int max_dist) {
 	FILE* in = fopen(input, "r");
 
 	unsigned long kmer;
 	int freq;
 	while (fscanf(in, "%lu\t%d\n", &kmer, &freq) == 2) {
 		if (freq <= max_dist) {
-			kmers->insert(kmer);
+			(*anchors)[kmer] |= flag;
 		}
 	}
 
 	fclose(in);
 }
 
-char matches_vmer(unsigned long kmer) {
-	dense_hash_set<unsigned long, kmer_hash, eqkmer>::const_iterator it = vmers->find(kmer);
-	return it != vmers->end();
+static inline uint32_t segment_val(uint32_t code, int offset, int len) {
+	return (code >> (offset*2)) & ((1U << (len*2)) - 1);
 }
 
-char matches_jmer(unsigned long kmer) {
-	dense_hash_set<unsigned long, kmer_hash, eqkmer>::const_iterator it = jmers->find(kmer);
-	return it != jmers->end();
+// Count of differing bases between 2 bit encoded kmers
+static inline int base_mismatches(uint32_t code1, uint32_t code2) {
+	uint32_t diff = code1 ^ code2;
+	return __builtin_popcount((diff | (diff >> 1)) & 0x55555555);
 }
 
-char is_stop_codon(char* codon) {
-	return strncmp(codon, "TAG", 3) == 0 || strncmp(codon, "TAA", 3) == 0 || strncmp(codon, "TGA", 3) == 0;
+void build_seed_matcher(dense_hash_map<uint64_t, char, kmer_hash, eqkmer>& germline, int max_dist) {
+	seed_matcher* matcher = new seed_matcher();
+
+	for (dense_hash_map<uint64_t, char, kmer_hash, eqkmer>::const_iterator it = germline.begin(); it != germline.end(); ++it) {
+		matcher->codes.push_back(it->first);
+		matcher->flags.push_back(it->second);
+	}
+
+	// Spread bases across segments as evenly as possible
+	matcher->num_segments = max_dist+1;
+	int offset = 0;
+	for (int s=0; s<matcher->num_segments; s++) {
+		int len = SEQ_LEN / matcher->num_segments + (s < SEQ_LEN % matcher->num_segments ? 1 : 0);
+		matcher->seg_offset[s] = offset;
+		matcher->seg_len[s] = len;
+		offset += len;
+
+		// Bucket anchors by segment value in CSR form
+		int num_buckets = 1 << (len*2);
+		vector<int>& start = matcher->bucket_start[s];
+		start.assign(num_buckets+1, 0);
+		for (size_t i=0; i<matcher->codes.size(); i++) {
+			start[segment_val(matcher->codes[i], matcher->seg_offset[s], len) + 1]++;
+		}
+		for (int b=0; b<num_buckets; b++) {
+			start[b+1] += start[b];
+		}
+
+		vector<int> fill(start.begin(), start.end()-1);
+		matcher->bucket_anchors[s].resize(matcher->codes.size());
+		for (size_t i=0; i<matcher->codes.size(); i++) {
+			matcher->bucket_anchors[s][fill[segment_val(matcher->codes[i], matcher->seg_offset[s], len)]++] = i;
+		}
+	}
+
+	anchor_seeds = matcher;
+
+	fprintf(stderr, "Pigeonhole anchor matcher: %ld germline anchors, %d segments, max mismatches: %d\n",
+			matcher->codes.size(), matcher->num_segments, max_dist);
 }
 
-char is_in_frame(int start, int end, int frame, char* contig) {
-	for (int i=start+frame; i<end+frame-3; i+=3) {
-		char* codon = contig + i;
-		if (is_stop_codon(codon)) {
-			return false;
+char seed_match_flags(uint32_t kmer) {
+	seed_matcher* matcher = anchor_seeds;
+	char flags = 0;
+
+	for (int s=0; s<matcher->num_segments && flags != (VJ_ANCHOR_V | VJ_ANCHOR_J); s++) {
+		uint32_t val = segment_val(kmer, matcher->seg_offset[s], matcher->seg_len[s]);
+		const vector<int>& start = matcher->bucket_start[s];
+
+		for (int i=start[val]; i<start[val+1]; i++) {
+			int anchor = matcher->bucket_anchors[s][i];
+			if ((matcher->flags[anchor] & ~flags) && base_mismatches(kmer, matcher->codes[anchor]) <= anchor_max_dist) {
+				flags |= matcher->flags[anchor];
+			}
 		}
 	}
 
-	return true;
+	return flags;
 }
 
-char is_in_frame(char* seq) {
-	for (int i=0; i<strlen(seq)-2; i+=3) {
-		char* codon = seq + i;
-		if (is_stop_codon(codon)) {
-			return false;
+char vj_anchor_flags(unsigned long kmer) {
+	if (anchor_seeds != NULL) {
+		return seed_match_flags(kmer);
+	}
+
+	if (anchor_idx != NULL) {
+		// Distances are filtered at query time
+		uint8_t dists = anchor_index_lookup(anchor_idx, kmer);
+		int v_dist = dists & 0xF;
+		int j_dist = dists >> 4;
+		char flags = 0;
+		if (v_dist != ANCHOR_INDEX_NO_DIST && v_dist <= anchor_max_dist) {
+			flags |= VJ_ANCHOR_V;
 		}
+		if (j_dist != ANCHOR_INDEX_NO_DIST && j_dist <= anchor_max_dist) {
+			flags |= VJ_ANCHOR_J;
+		}
+		return flags;
 	}
 
-	return true;
+	dense_hash_map<uint64_t, char, kmer_hash, eqkmer>::const_iterator it = anchors->find(kmer);
+	return it != anchors->end() ? it->second : 0;
 }
 
-// Look for a window of a few hundred bases without a stop codon
-int find_frame(char* contig, int v, int window) {
+char matches_vmer(unsigned long kmer) {
+	return (vj_anchor_flags(kmer) & VJ_ANCHOR_V) != 0;
+}
 
-	int start = v - FRAME_PADDING;
-	int end = v + window + FRAME_PADDING;
+char matches_jmer(unsigned long kmer) {
+	return (vj_anchor_flags(kmer) & VJ_ANCHOR_J) != 0;
+}
 
-	int frame = -1;;
+//
+// Scan contig for V / J anchors using a rolling 2 bit code.  Windows containing ambiguous
+// bases are skipped.  Hit positions are appended in increasing order.
+void scan_anchors(const char* contig, int len, vector<int>& v_indices, vector<int>& j_indices) {
+	uint32_t code = 0;
+	int valid = 0;
+
+	for (int i=0; i<len+SEQ_LEN-1; i++) {
+		int val = anchor_base_vals[(unsigned char) contig[i]];
+		if (val < 0) {
+			valid = 0;
+			code = 0;
+			continue;
+		}
 
-	for (int i=0; i<3; i++) {
-		if (is_in_frame(start, end, i, contig)) {
-			if (frame != -1) {
-				fprintf(stderr, "Multiple frames in: %s : %d\n", contig, v);
-			} else {
-				frame = i;
+		code = (code << 2) | val;
+		valid++;
+
+		if (valid >= SEQ_LEN) {
+			char flags = vj_anchor_flags(code);
+			if (flags) {
+				int pos = i-SEQ_LEN+1;
+				if (flags & VJ_ANCHOR_V) {
+					v_indices.push_back(pos);
+				}
+				if (flags & VJ_ANCHOR_J) {
+					j_indices.push_back(pos);
+				}
 			}
 		}
 	}
+}
+
+// Codon classes indexed by 6 bit codon code
+#define CODON_STOP 1
+#define CODON_CYS 2
+#define CODON_J_CONSERVED 4
+
+char codon_classes[64];
+
+static int codon_code(const char* codon) {
+	int code = 0;
+	for (int i=0; i<3; i++) {
+		int val = anchor_base_vals[(unsigned char) codon[i]];
+		if (val < 0) {
+			return -1;
+		}
+		code = (code << 2) | val;
+	}
 
-	return frame;
+	return code;
 }
 
-void find_conserved_aminos(int v_index, int j_index, char* contig,
-		sparse_hash_set<const char*, vjf_hash, vjf_eqstr>& cdr3_seq, char*& cdr3) {
+void init_codon_classes() {
 	// BCR heavy has conserved Cysteine in V and Tryptophan in J
 	// BCR light, TCR light & heavy have conserved Cysteine in V and Phenylalaline in J
 	// Cysteine : C :  TGT,TGC
@@ -134,68 +259,203 @@ void find_conserved_aminos(int v_index, int j_index, char* contig,
 	//
 	// See: http://www.ncbi.nlm.nih.gov/pmc/articles/PMC441550/
 
+	memset(codon_classes, 0, sizeof(codon_classes));
+
+	codon_classes[codon_code("TAG")] |= CODON_STOP;
+	codon_classes[codon_code("TAA")] |= CODON_STOP;
+	codon_classes[codon_code("TGA")] |= CODON_STOP;
+
+	codon_classes[codon_code("TGT")] |= CODON_CYS;
+	codon_classes[codon_code("TGC")] |= CODON_CYS;
+
+	if (J_CONSERVED == 'W') {
+		codon_classes[codon_code("TGG")] |= CODON_J_CONSERVED;
+	} else if (J_CONSERVED == 'F') {
+		codon_classes[codon_code("TTC")] |= CODON_J_CONSERVED;
+		codon_classes[codon_code("TTT")] |= CODON_J_CONSERVED;
+	}
+}
+
+// CDR3 located by offset within the contig being searched
+struct cdr3_span {
+	int start;
+	int len;
+};
+
+//
+// Per thread scratch space reused across searches
+struct window_scan {
 	vector<int> v_indices;
 	vector<int> j_indices;
+	vector<int> cys;
+	vector<int> j_conserved;
+	// Count of stop codons starting prior to each position in the same frame
+	vector<int> stop_prefix;
+	vector<cdr3_span> spans;
+	vector<cdr3_span> distinct;
+	vector<cdr3_span> candidates;
+	vector<int> window_starts;
+	// Returned windows and CDR3s.  Reset per root.
+	arena windows;
+};
+
+static __thread window_scan* thread_scan = NULL;
 
-	for (int i=v_index; i<SEQ_LEN+ANCHOR_PADDING+v_index-2; i++) {
-		char ch[4];
-		strncpy(ch, contig+i, 3);
-		ch[3] = 0;
+#define WINDOW_ARENA_CHUNK_SIZE (256*1024)
+#define WINDOW_ARENA_MAX_SIZE (64L*1024L*1024L)
 
-		if (strncmp(contig+i, "TGT", 3) == 0 || strncmp(contig+i, "TGC", 3) == 0) {
-//			fprintf(stderr, "C @ %d\n", i);
-			v_indices.push_back(i);
+long window_arena_peak = 0;
+long window_arena_capacity = 0;
+long window_arena_exhausted = 0;
+
+// Order by length then sequence, with lowest start first among identical CDR3s
+struct span_order
+{
+	const char* contig;
+
+	bool operator()(const cdr3_span& s1, const cdr3_span& s2) const
+	{
+		if (s1.len != s2.len) {
+			return s1.len < s2.len;
 		}
+
+		int cmp = memcmp(contig + s1.start, contig + s2.start, s1.len);
+		return cmp != 0 ? cmp < 0 : s1.start < s2.start;
 	}
+};
 
-	// TODO: Parameterize for Phenylalaline
-	for (int i=j_index-ANCHOR_PADDING; i<SEQ_LEN+j_index-2; i++) {
-		char ch[4];
-		strncpy(ch, contig+i, 3);
-		ch[3] = 0;
+// Single pass over the contig classifying the codon starting at each position.
+// Stop codon prefix counts are only computed if count_stops is set.
+void classify_codons(const char* contig, int contig_len, window_scan* scan, char count_stops) {
+	scan->cys.clear();
+	scan->j_conserved.clear();
+	if (count_stops) {
+		scan->stop_prefix.assign(contig_len+1, 0);
+	}
 
-		if (J_CONSERVED == 'W' && strncmp(contig+i, "TGG", 3) == 0) {
-//			fprintf(stderr, "W @ %d\n", i);
-			j_indices.push_back(i);
-		} else if (J_CONSERVED == 'F' && (strncmp(contig+i, "TTC", 3) == 0 || strncmp(contig+i, "TTT", 3) == 0)) {
-//			fprintf(stderr, "J @ %d\n", i);
-			j_indices.push_back(i);
+	int code = 0;
+	int valid = 0;
+	for (int i=0; i<contig_len; i++) {
+		int val = anchor_base_vals[(unsigned char) contig[i]];
+		if (val < 0) {
+			valid = 0;
+		} else {
+			code = ((code << 2) | val) & 0x3F;
+			valid++;
+		}
+
+		if (i+1 >= 3) {
+			int pos = i-2;
+			char codon_class = valid >= 3 ? codon_classes[code] : 0;
+
+			if (codon_class & CODON_CYS) {
+				scan->cys.push_back(pos);
+			}
+			if (codon_class & CODON_J_CONSERVED) {
+				scan->j_conserved.push_back(pos);
+			}
+			if (count_stops) {
+				scan->stop_prefix[pos+3] = scan->stop_prefix[pos] + ((codon_class & CODON_STOP) ? 1 : 0);
+			}
 		}
 	}
+}
+
+char vjf_is_stop_codon(const char* codon) {
+	int code = codon_code(codon);
+	return code >= 0 && (codon_classes[code] & CODON_STOP);
+}
 
-//	char* cdr3 = cdr3_block;
+void vjf_stop_codons(const char* seq, int len, uint64_t* stop_codons) {
+	int code = 0;
+	int valid = 0;
+	for (int i=0; i<len; i++) {
+		int val = anchor_base_vals[(unsigned char) seq[i]];
+		if (val < 0) {
+			valid = 0;
+		} else {
+			code = ((code << 2) | val) & 0x3F;
+			valid++;
+		}
 
-	vector<int>::const_iterator v;
-	for (v=v_indices.begin(); v!=v_indices.end(); v++) {
-		vector<int>::const_iterator j;
-		for (j=j_indices.begin(); j!=j_indices.end(); j++) {
-			// For each C, (W/F) combo, check the distance and frame
-			int window = *j - *v + 3;
+		if (valid >= 3 && (codon_classes[code] & CODON_STOP)) {
+			int pos = i-2;
+			stop_codons[pos / 64] |= 1ULL << (pos % 64);
+		}
+	}
+}
+
+// Bits at every third position starting from bit 0, 1 and 2
+static const uint64_t frame_masks[3] = {
+	0x9249249249249249ULL,
+	0x2492492492492492ULL,
+	0x4924924924924924ULL,
+};
+
+//
+// Return true if no stop codon starts at start + 3k for k < num_codons
+char is_open_frame(const uint64_t* stop_codons, int start, int num_codons) {
+	int end = start + num_codons*3 - 2;
+
+	for (int word = start / 64; word*64 < end; word++) {
+		uint64_t mask = frame_masks[((start - word*64) % 3 + 3) % 3];
+
+		// Clear bits outside of [start, end)
+		if (word*64 < start) {
+			mask &= ~0ULL << (start - word*64);
+		}
+		if (end - word*64 < 64) {
+			mask &= (1ULL << (end - word*64)) - 1;
+		}
 
-//			fprintf(stderr, "window: %d\tj:\t*jv:%d*v\n", window, *j, *v);
+		if (stop_codons[word] & mask) {
+			return false;
+		}
+	}
 
-			// TODO: Parameterize min/max window
-			if (window % 3 == 0 && window >= MIN_WINDOW && window <= MAX_WINDOW && *j >= *v) {
+	return true;
+}
+
+//
+// Pair each Cys within the V anchor region with each conserved J AA within the J anchor region
+// where the resulting CDR3 is in frame and sized within bounds.
+void find_conserved_aminos(int v_index, int j_index, window_scan* scan) {
+	int v_end = v_index + SEQ_LEN + ANCHOR_PADDING - 2;
+	int j_start = j_index - ANCHOR_PADDING < 0 ? 0 : j_index - ANCHOR_PADDING;
+	int j_end = j_index + SEQ_LEN - 2;
 
-				strncpy(cdr3, contig+*v, window);
-				cdr3[window] = '\0';
+	const vector<int>& j_conserved = scan->j_conserved;
+	vector<int>::const_iterator j_first = lower_bound(j_conserved.begin(), j_conserved.end(), j_start);
+	vector<int>::const_iterator j_last = lower_bound(j_first, j_conserved.end(), j_end);
 
-//				if (PRINT_CDR3_INDEX) {
-//					fprintf(stderr, "contig: [%s]\t cdr3: [%s]\tV: [%d]\tJ: [%d]\n", contig, cdr3, *v, *j);
-//					fprintf(stderr, "contig: [%s]\tV: [%d]\tJ: [%d]\n", contig, *v, *j);
-//					printf("%s\t%s\t%d\t%d\n", contig, cdr3, *v, *j);
-//				}
+	const vector<int>& cys = scan->cys;
+	for (vector<int>::const_iterator v = lower_bound(cys.begin(), cys.end(), v_index); v != cys.end() && *v < v_end; v++) {
+
+		for (vector<int>::const_iterator j = lower_bound(j_first, j_last, *v); j != j_last; j++) {
+			int window = *j - *v + 3;
 
-				cdr3_seq.insert(cdr3);
-				cdr3 += 1024;
+			if (window > MAX_WINDOW) {
+				break;
+			}
+
+			if (window % 3 == 0 && window >= MIN_WINDOW) {
+				cdr3_span span;
+				span.start = *v;
+				span.len = window;
+				scan->spans.push_back(span);
 			}
 		}
 	}
 }
 
-char is_sub_string(const char* str, sparse_hash_set<const char*, vjf_hash, vjf_eqstr> cdr3_seq) {
-	for (sparse_hash_set<const char*, vjf_hash, vjf_eqstr>::iterator it=cdr3_seq.begin(); it!=cdr3_seq.end(); it++) {
-		if (strstr(*it, str) != NULL && strcmp(*it, str) !=0) {
+//
+// Return true if span is a proper substring of another CDR3 in spans.
+// spans is sorted by length and contains distinct CDR3 sequences.
+char is_sub_string(const char* contig, const cdr3_span& span, const vector<cdr3_span>& spans) {
+	for (vector<cdr3_span>::const_reverse_iterator it=spans.rbegin(); it!=spans.rend() && it->len > span.len; it++) {
+		// Containing interval is sufficient.  Otherwise compare sequence.
+		if ((it->start <= span.start && span.start + span.len <= it->start + it->len) ||
+			memmem(contig + it->start, it->len, contig + span.start, span.len) != NULL) {
 			return true;
 		}
 	}
@@ -203,107 +463,122 @@ char is_sub_string(const char* str, sparse_hash_set<const char*, vjf_hash, vjf_e
 	return false;
 }
 
-// Thread local CDR3 buffer
-__thread char* vjf_cdr3_block_buffer;
+void print_windows(char* contig, dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings,
+		const uint64_t* stop_codons) {
 
-void print_windows(char* contig, dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings) {
+	if (thread_scan == NULL) {
+		thread_scan = new window_scan();
+		arena_init(&thread_scan->windows, WINDOW_ARENA_CHUNK_SIZE, WINDOW_ARENA_MAX_SIZE);
+	}
+	window_scan* scan = thread_scan;
 
-	char* cdr3_block = vjf_cdr3_block_buffer;
+	int contig_len = strlen(contig);
+	int len = contig_len - SEQ_LEN;
 
-	sparse_hash_set<const char*, vjf_hash, vjf_eqstr> cdr3_seq;
+	scan->v_indices.clear();
+	scan->j_indices.clear();
+	scan_anchors(contig, len, scan->v_indices, scan->j_indices);
 
-	char* contig_index = contig;
-	vector<int> v_indices;
-	vector<int> j_indices;
-
-	int len = strlen(contig) - SEQ_LEN;
+	if (scan->v_indices.empty() || scan->j_indices.empty()) {
+		return;
+	}
 
-	for (int i=0; i<len; i++) {
-		unsigned long kmer = seq_to_int(contig_index);
+	classify_codons(contig, contig_len, scan, stop_codons == NULL);
 
-//		if (kmer == 0) {
-//			printf("STRANGE CONTIG: %s\n", contig);
-//			fflush(stdout);
-//		}
+	if (scan->cys.empty() || scan->j_conserved.empty()) {
+		return;
+	}
 
-		if (matches_vmer(kmer)) {
-			v_indices.push_back(i);
+	// Anchor indices are sorted, so the J anchors within range of each V anchor
+	// are found with a pair of pointers advancing monotonically.
+	int pad = SEQ_LEN*2 + ANCHOR_PADDING*2;
+	scan->spans.clear();
+
+	vector<int>& j_indices = scan->j_indices;
+	int j_lo = 0;
+	int j_hi = 0;
+	for (vector<int>::const_iterator v=scan->v_indices.begin(); v!=scan->v_indices.end(); v++) {
+		// window = j - v + SEQ_LEN within [MIN_WINDOW, MAX_WINDOW+pad] and less than contig length
+		int min_j = *v + MIN_WINDOW - SEQ_LEN;
+		int max_j = *v + min(MAX_WINDOW+pad, contig_len-1) - SEQ_LEN;
+
+		while (j_lo < j_indices.size() && j_indices[j_lo] < min_j) {
+			j_lo++;
 		}
-
-		if (matches_jmer(kmer)) {
-			j_indices.push_back(i);
+		if (j_hi < j_lo) {
+			j_hi = j_lo;
+		}
+		while (j_hi < j_indices.size() && j_indices[j_hi] <= max_j) {
+			j_hi++;
 		}
 
-		contig_index += 1;
+		for (int j=j_lo; j<j_hi; j++) {
+			find_conserved_aminos(*v, j_indices[j], scan);
+		}
 	}
 
-	// TODO: traverse vectors in parallel and more intelligently.
-	//       no need to compare all values
-	vector<int>::const_iterator v;
-	for (v=v_indices.begin(); v!=v_indices.end(); v++) {
-		vector<int>::const_iterator j;
-		for (j=j_indices.begin(); j!=j_indices.end(); j++) {
-			int window = *j - *v + SEQ_LEN;
+	if (scan->spans.empty()) {
+		return;
+	}
 
-			int pad = SEQ_LEN*2 + ANCHOR_PADDING*2;
+	// Collapse to distinct CDR3 sequences keeping the first occurrence
+	span_order order;
+	order.contig = contig;
+	sort(scan->spans.begin(), scan->spans.end(), order);
 
-			if (window >= MIN_WINDOW && window <= MAX_WINDOW+pad && strlen(contig) > window) {
-				find_conserved_aminos(*v, *j, contig, cdr3_seq, cdr3_block);
-			}
+	scan->distinct.clear();
+	for (vector<cdr3_span>::const_iterator it=scan->spans.begin(); it!=scan->spans.end(); it++) {
+		if (scan->distinct.empty() || scan->distinct.back().len != it->len ||
+			memcmp(contig + scan->distinct.back().start, contig + it->start, it->len) != 0) {
+			scan->distinct.push_back(*it);
 		}
 	}
 
-	dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr> windows_temp;
-	sparse_hash_set<const char*, vjf_hash, vjf_eqstr> cdr3_temp;
-	windows_temp.set_empty_key(NULL);
-
-	sparse_hash_set<const char*, vjf_hash, vjf_eqstr>::const_iterator it;
-	for (it=cdr3_seq.begin(); it!=cdr3_seq.end(); it++) {
-
-		if (allow_cdr3_substrings || !is_sub_string(*it, cdr3_seq)) {
-
-			int window = strlen(*it);
+	scan->candidates.clear();
+	scan->window_starts.clear();
+	// Longest CDR3s first so that they are kept where CDR3s share a window
+	for (vector<cdr3_span>::const_reverse_iterator it=scan->distinct.rbegin(); it!=scan->distinct.rend(); it++) {
 
-			// Find current CDR3 string in contig
-			char* start = strstr(contig, *it);
+		if (allow_cdr3_substrings || !is_sub_string(contig, *it, scan->distinct)) {
 
-			if (start != NULL) {
+			int vpad = WINDOW_SPAN - (it->len + J_EXTENSION);
+			int start = it->start - vpad;
 
-				int vpad = WINDOW_SPAN - (window + J_EXTENSION);
+			if (start >= 0 && contig_len - start > WINDOW_SPAN) {
 
-				start -= vpad;
+				// Count stop codons in frame with the window start
+				int num_codons = WINDOW_SPAN / 3;
+				char is_in_frame = stop_codons != NULL ? is_open_frame(stop_codons, start, num_codons) :
+						scan->stop_prefix[start + num_codons*3] == scan->stop_prefix[start];
 
-				if (strlen(start) > WINDOW_SPAN) {
-					char win[1024];
-					memset(win, 0, 1024);
-					strncpy(win, start, WINDOW_SPAN);
-
-					if (is_in_frame(win)) {
-						if (windows_temp.find(win) == windows_temp.end()) {
-
-							char* final_win = (char*) calloc(1024, sizeof(char));
-							char* final_cdr3 = (char*) calloc(256, sizeof(char));
-							strcpy(final_win, win);
-							strcpy(final_cdr3, *it);
+				if (is_in_frame) {
+					char is_dup = false;
+					for (int i=0; i<scan->window_starts.size() && !is_dup; i++) {
+						is_dup = memcmp(contig + scan->window_starts[i], contig + start, WINDOW_SPAN) == 0;
+					}
 
-							windows_temp[final_win] = final_cdr3;
-							cdr3_temp.insert(final_cdr3);
-						}
+					if (!is_dup) {
+						scan->window_starts.push_back(start);
+						scan->candidates.push_back(*it);
 					}
 				}
 			}
 		}
 	}
 
-	// Loop back through windows_temp copying results to windows iff cdr3 is not a subset of another cdr3.
-	for (dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>::const_iterator it = windows_temp.begin();
-			it != windows_temp.end(); ++it) {
+	// Restore length order
+	reverse(scan->candidates.begin(), scan->candidates.end());
+	reverse(scan->window_starts.begin(), scan->window_starts.end());
 
-		const char* contig = it->first;
-		const char* cdr3 = it->second;
+	// Output windows iff cdr3 is not a subset of another candidate window's cdr3.
+	for (int i=0; i<scan->candidates.size(); i++) {
+		const cdr3_span& cdr3 = scan->candidates[i];
 
-		if (!is_sub_string(cdr3, cdr3_temp)) {
-			windows[contig] = cdr3;
+		if (!is_sub_string(contig, cdr3, scan->candidates)) {
+			char* final_win = arena_strcpy(&scan->windows, contig + scan->window_starts[i], WINDOW_SPAN);
+			char* final_cdr3 = arena_strcpy(&scan->windows, contig + cdr3.start, cdr3.len);
+
+			windows[final_win] = final_cdr3;
 		}
 	}
 }
@@ -311,21 +586,79 @@ void print_windows(char* contig, dense_hash_map<const char*, const char*, vjf_ha
 void init(char* v_file, char* j_file, int max_dist) {
 	pthread_mutex_init(&vjf_mutex, NULL);
 
-	vmers = new dense_hash_set<unsigned long, kmer_hash, eqkmer>();
-	jmers = new dense_hash_set<unsigned long, kmer_hash, eqkmer>();
+	memset(anchor_base_vals, -1, sizeof(anchor_base_vals));
+	anchor_base_vals['A'] = 0;
+	anchor_base_vals['T'] = 1;
+	anchor_base_vals['C'] = 2;
+	anchor_base_vals['G'] = 3;
+
+	anchor_max_dist = max_dist;
+
+	init_codon_classes();
+
+	// With no mismatches allowed, seeds would span the entire anchor.  The anchor table and
+	// binary index both reduce to exact germline lookups in that case, so are used instead.
+	if (use_seed_matcher && max_dist == 0) {
+		fprintf(stderr, "Anchor mismatches are 0.  Using exact anchor lookup in place of the pigeonhole matcher\n");
+	}
+
+	if (use_seed_matcher && max_dist > 0) {
+		if (max_dist >= SEQ_LEN) {
+			fprintf(stderr, "Anchor mismatches must be less than %d\n", SEQ_LEN);
+			exit(-1);
+		}
 
-	vmers->set_empty_key(0);
-	jmers->set_empty_key(0);
+		// Only germline anchors are needed.  These are the dist 0 entries of the anchor index.
+		dense_hash_map<uint64_t, char, kmer_hash, eqkmer> germline;
+		germline.set_empty_key(ANCHOR_EMPTY_KEY);
+
+		if (anchor_idx != NULL) {
+			for (uint32_t i=0; i<anchor_idx->num_entries; i++) {
+				uint8_t dists = anchor_idx->dists[i];
+				if ((dists & 0xF) == 0) {
+					germline[anchor_idx->codes[i]] |= VJ_ANCHOR_V;
+				}
+				if ((dists >> 4) == 0) {
+					germline[anchor_idx->codes[i]] |= VJ_ANCHOR_J;
+				}
+			}
+		} else {
+			anchors = &germline;
+			load_kmers(v_file, VJ_ANCHOR_V, 0);
+			load_kmers(j_file, VJ_ANCHOR_J, 0);
+			anchors = NULL;
+		}
+
+		build_seed_matcher(germline, max_dist);
+		return;
+	}
+
+	if (anchor_idx != NULL) {
+		fprintf(stderr, "Using binary anchor index with %u kmers\n", anchor_idx->num_entries);
+		return;
+	}
+
+	anchors = new dense_hash_map<uint64_t, char, kmer_hash, eqkmer>();
+	anchors->set_empty_key(ANCHOR_EMPTY_KEY);
 
 	fprintf(stderr, "Loading vmers\n");
 	fflush(stderr);
-	load_kmers(v_file, vmers, max_dist);
+	load_kmers(v_file, VJ_ANCHOR_V, max_dist);
 	fprintf(stderr, "Loading jmers\n");
 	fflush(stderr);
-	load_kmers(j_file, jmers, max_dist);
+	load_kmers(j_file, VJ_ANCHOR_J, max_dist);
 
 }
 
+void vjf_use_seed_matcher() {
+	use_seed_matcher = 1;
+}
+
+char vjf_load_anchor_index(char* index_file) {
+	anchor_idx = anchor_index_open(index_file);
+	return anchor_idx != NULL;
+}
+
 void vjf_init(char* v_file, char* j_file, int max_dist, int min_win, int max_win,
 		char j_conserved, int window_span, int j_extension) {
 
@@ -340,8 +673,39 @@ void vjf_init(char* v_file, char* j_file, int max_dist, int min_win, int max_win
 
 
 
-void vjf_search(char* contig, dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings) {
-	print_windows(contig, windows, allow_cdr3_substrings);
+void vjf_search(char* contig, dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings,
+		const uint64_t* stop_codons) {
+	print_windows(contig, windows, allow_cdr3_substrings, stop_codons);
+}
+
+void vjf_reset_windows() {
+	if (thread_scan == NULL) {
+		return;
+	}
+
+	arena_reset(&thread_scan->windows);
+}
+
+void vjf_release_thread() {
+	if (thread_scan != NULL) {
+		arena* windows = &thread_scan->windows;
+
+		// Peak and exhaustion counts accumulate across resets
+		pthread_mutex_lock(&vjf_mutex);
+		window_arena_peak = max(window_arena_peak, windows->peak);
+		window_arena_capacity = max(window_arena_capacity, arena_capacity(windows));
+		window_arena_exhausted += windows->num_exhausted;
+		pthread_mutex_unlock(&vjf_mutex);
+
+		arena_destroy(windows);
+		delete thread_scan;
+		thread_scan = NULL;
+	}
+}
+
+void vjf_print_arena_stats() {
+	fprintf(stderr, "Window arena: peak %ld bytes, max capacity %ld bytes per thread, %ld allocations beyond %ld byte limit\n",
+			window_arena_peak, window_arena_capacity, window_arena_exhausted, WINDOW_ARENA_MAX_SIZE);
 }
 
 /*
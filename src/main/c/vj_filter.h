@@ -1,16 +1,52 @@
 #ifndef __VJ_FILTER__
 #define __VJ_FILTER__
 
-//char PRINT_CDR3_INDEX = 0;
+#include <stdint.h>
 
-extern __thread char* vjf_cdr3_block_buffer;
+//char PRINT_CDR3_INDEX = 0;
 
 // Init V and J anchor indices as well as search params
 void vjf_init(char* v_file, char* j_file, int max_dist, int min_win, int max_win,
 		char j_conserved, int window_span, int j_extension);
 
-// Search for candidate VDJ windows
-void vjf_search(char* contig, google::dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings);
+// Use the binary anchor index in place of the V / J text index files.
+// Must be called prior to vjf_init.  Returns false if the index cannot be loaded.
+char vjf_load_anchor_index(char* index_file);
+
+// Match anchors on the fly within max_dist mismatches of germline anchors
+// rather than against the expanded index.  Must be called prior to vjf_init.
+void vjf_use_seed_matcher();
+
+// Search for candidate VDJ windows.  Window and CDR3 strings are owned by a per thread
+// arena and remain valid until vjf_reset_windows is called on the same thread.
+// stop_codons optionally supplies the contig's stop codon bitmap (see vjf_stop_codons).
+// If NULL, stop codons are located during the search.
+void vjf_search(char* contig, google::dense_hash_map<const char*, const char*, vjf_hash, vjf_eqstr>& windows, char allow_cdr3_substrings,
+		const uint64_t* stop_codons);
+
+// Number of 64 bit words in a stop codon bitmap covering len bases
+#define VJF_STOP_WORDS(len) (((len)+63) / 64)
+
+// Set bit i of stop_codons for each stop codon starting at seq[i] and contained in seq
+void vjf_stop_codons(const char* seq, int len, uint64_t* stop_codons);
+
+// Return true if the 3 bases at codon form a stop codon
+char vjf_is_stop_codon(const char* codon);
+
+// Release windows returned by vjf_search on the calling thread
+void vjf_reset_windows();
+
+// Release all per thread search state
+void vjf_release_thread();
+
+// Report window arena usage across threads
+void vjf_print_arena_stats();
+
+#define VJ_ANCHOR_V 1
+#define VJ_ANCHOR_J 2
+
+// Return VJ_ANCHOR_V / VJ_ANCHOR_J flags for the input kmer
+char vj_anchor_flags(unsigned long kmer);
 
 // Return true if the input kmer matches a cached vmer
 char matches_vmer(unsigned long kmer);
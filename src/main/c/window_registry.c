@@ -0,0 +1,201 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <vector>
+#include <sparsehash/dense_hash_map>
+#include <sparsehash/dense_hash_set>
+#include "window_registry.h"
+#include "arena.h"
+
+using namespace std;
+using google::dense_hash_map;
+using google::dense_hash_set;
+
+uint64_t MurmurHash64A ( const void * key, int len, uint64_t seed );
+
+//
+// Candidate and validated windows are spread across shards by fingerprint,
+// each shard guarded by its own spinlock.  Hashing and string copies happen
+// outside of the lock so critical sections are a single hash table probe.
+//
+
+#define NUM_SHARDS 256
+#define FP_SEED1 97
+#define FP_SEED2 0x9E3779B97F4A7C15ULL
+
+// Validated window / cdr3 strings and mappings are copied into per thread arenas of chunks of this size.
+// Store arenas are never reset.
+#define STORE_CHUNK_SIZE (1024*1024)
+#define MAPPING_ALIGN 8
+
+struct fp_hash
+{
+	size_t operator()(const window_fp& fp) const
+	{
+		return fp.h2;
+	}
+};
+
+struct fp_eq
+{
+	bool operator()(const window_fp& fp1, const window_fp& fp2) const
+	{
+		return fp1.h1 == fp2.h1 && fp1.h2 == fp2.h2;
+	}
+};
+
+struct registry_shard {
+	pthread_spinlock_t lock;
+	dense_hash_set<window_fp, fp_hash, fp_eq> candidates;
+	dense_hash_map<window_fp, window_entry, fp_hash, fp_eq> windows;
+	// Pad shards to separate cache lines
+	char pad[64];
+};
+
+static registry_shard* shards = NULL;
+
+static int contig_num = 1;
+static long num_candidates = 0;
+static long num_windows = 0;
+static long store_bytes = 0;
+
+static __thread arena* store = NULL;
+
+window_fp window_fingerprint(const char* seq, int len) {
+	window_fp fp;
+	fp.h1 = MurmurHash64A(seq, len, FP_SEED1);
+	fp.h2 = MurmurHash64A(seq, len, FP_SEED2);
+
+	// All zero fingerprint is reserved for the empty key
+	if (fp.h1 == 0 && fp.h2 == 0) {
+		fp.h2 = 1;
+	}
+
+	return fp;
+}
+
+void wr_init() {
+	window_fp empty_key;
+	empty_key.h1 = 0;
+	empty_key.h2 = 0;
+
+	shards = new registry_shard[NUM_SHARDS];
+	for (int i=0; i<NUM_SHARDS; i++) {
+		pthread_spin_init(&shards[i].lock, PTHREAD_PROCESS_PRIVATE);
+		shards[i].candidates.set_empty_key(empty_key);
+		shards[i].windows.set_empty_key(empty_key);
+	}
+}
+
+static inline registry_shard* get_shard(window_fp fp) {
+	return &shards[fp.h1 % NUM_SHARDS];
+}
+
+static arena* get_store() {
+	if (store == NULL) {
+		store = new arena();
+		arena_init(store, STORE_CHUNK_SIZE, 0);
+	}
+
+	return store;
+}
+
+static char* store_copy(const char* str, int len) {
+	__sync_fetch_and_add(&store_bytes, len+1);
+
+	return arena_strcpy(get_store(), str, len);
+}
+
+static pair_mapping* store_mappings(const vector<pair_mapping>& mappings) {
+	if (mappings.empty()) {
+		return NULL;
+	}
+
+	int len = mappings.size() * sizeof(pair_mapping);
+	__sync_fetch_and_add(&store_bytes, len);
+
+	// Strings leave the arena unaligned.  Over allocate and align the copy.
+	char* buf = arena_alloc(get_store(), len + MAPPING_ALIGN-1);
+	pair_mapping* copy = (pair_mapping*) (((uintptr_t) buf + MAPPING_ALIGN-1) & ~(uintptr_t) (MAPPING_ALIGN-1));
+	memcpy(copy, &mappings[0], len);
+
+	return copy;
+}
+
+char wr_add_candidate(window_fp fp) {
+	registry_shard* shard = get_shard(fp);
+
+	pthread_spin_lock(&shard->lock);
+	char is_added = shard->candidates.insert(fp).second;
+	pthread_spin_unlock(&shard->lock);
+
+	if (is_added) {
+		__sync_fetch_and_add(&num_candidates, 1);
+	}
+
+	return is_added;
+}
+
+char wr_contains_window(window_fp fp) {
+	registry_shard* shard = get_shard(fp);
+
+	pthread_spin_lock(&shard->lock);
+	char is_found = shard->windows.find(fp) != shard->windows.end();
+	pthread_spin_unlock(&shard->lock);
+
+	return is_found;
+}
+
+char wr_add_window(window_fp fp, const char* window, int window_len, const char* cdr3,
+		const vector<pair_mapping>& mappings) {
+
+	// Copy outside of the lock, publish under it.
+	window_entry entry;
+	entry.window = store_copy(window, window_len);
+	entry.cdr3 = store_copy(cdr3, strlen(cdr3));
+	entry.mappings = store_mappings(mappings);
+	entry.num_mappings = mappings.size();
+
+	registry_shard* shard = get_shard(fp);
+
+	pthread_spin_lock(&shard->lock);
+	char is_added = shard->windows.insert(make_pair(fp, entry)).second;
+	pthread_spin_unlock(&shard->lock);
+
+	// Store copies of duplicates are not reclaimed.  Duplicates are rare since
+	// candidates are deduped before validation.
+	if (is_added) {
+		__sync_fetch_and_add(&num_windows, 1);
+	}
+
+	return is_added;
+}
+
+int wr_next_contig_num() {
+	return __sync_fetch_and_add(&contig_num, 1);
+}
+
+long wr_num_candidates() {
+	return num_candidates;
+}
+
+long wr_num_windows() {
+	return num_windows;
+}
+
+long wr_store_bytes() {
+	return store_bytes;
+}
+
+void wr_get_windows(vector<window_entry>& windows) {
+	for (int i=0; i<NUM_SHARDS; i++) {
+		pthread_spin_lock(&shards[i].lock);
+		for (dense_hash_map<window_fp, window_entry, fp_hash, fp_eq>::iterator it=shards[i].windows.begin();
+				it!=shards[i].windows.end(); it++) {
+			windows.push_back(it->second);
+		}
+		pthread_spin_unlock(&shards[i].lock);
+	}
+}
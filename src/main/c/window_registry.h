@@ -0,0 +1,53 @@
+#ifndef __WINDOW_REGISTRY__
+#define __WINDOW_REGISTRY__
+
+#include <stdint.h>
+#include <vector>
+#include "quick_map3.h"
+
+//
+// 128 bit window fingerprint.  Windows are deduped on fingerprint alone.
+struct window_fp {
+	uint64_t h1;
+	uint64_t h2;
+};
+
+struct window_entry {
+	const char* window;
+	const char* cdr3;
+	// Read pairs mapped to the window during validation
+	const pair_mapping* mappings;
+	int num_mappings;
+};
+
+window_fp window_fingerprint(const char* seq, int len);
+
+// Initialize registry shards
+void wr_init();
+
+// Add fingerprint to the candidate set.  Returns 1 if it was not already present.
+char wr_add_candidate(window_fp fp);
+
+// Return true if a validated window with the input fingerprint exists
+char wr_contains_window(window_fp fp);
+
+// Add a validated window along with its mapped read pairs.  window, cdr3 and mappings
+// are copied to the registry store, so callers may release their own copies.
+// Returns 1 if the window was not already present.
+char wr_add_window(window_fp fp, const char* window, int window_len, const char* cdr3,
+		const std::vector<pair_mapping>& mappings);
+
+// Atomically assign the next contig number
+int wr_next_contig_num();
+
+long wr_num_candidates();
+
+long wr_num_windows();
+
+// Bytes of window / cdr3 strings and mappings held by the registry store
+long wr_store_bytes();
+
+// Collect all validated windows
+void wr_get_windows(std::vector<window_entry>& windows);
+
+#endif // __WINDOW_REGISTRY__